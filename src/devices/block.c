@@ -4,7 +4,77 @@
 #include <stdio.h>
 #include "devices/ide.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "devices/timer.h"
+
+/* Timer ticks a read or write may wait in a queue before the
+   deadline scheduler serves it ahead of others. */
+#define READ_DEADLINE (TIMER_FREQ / 20)
+#define WRITE_DEADLINE (TIMER_FREQ / 2)
+
+/* Limits on the requests merged into a single driver call. */
+#define MERGE_MAX_REQUESTS 32           /* Requests. */
+#define MERGE_MAX_IOVS 64               /* Iovecs. */
+#define MERGE_MAX_SECTORS 256           /* Sectors. */
+
+/* Number of log2 buckets in latency histograms, which count
+   CPU cycles. */
+#define LATENCY_BUCKETS 40
+
+/* Number of log2 buckets in request size histograms, which count
+   sectors: 1, 2 to 3, 4 to 7, ..., 256 or more. */
+#define SIZE_BUCKETS 9
+
+/* Statistics about the requests submitted to a block device. */
+struct block_stats
+  {
+    unsigned long long latency[LATENCY_BUCKETS]; /* Submit to complete. */
+    unsigned long long wait[LATENCY_BUCKETS];    /* Waiting in queue. */
+    unsigned long long service[LATENCY_BUCKETS]; /* Served by driver. */
+    unsigned long long size[SIZE_BUCKETS];       /* Sectors per request. */
+    unsigned long long request_cnt;     /* Number of requests. */
+    unsigned long long sequential_cnt;  /* Requests starting at NEXT. */
+    block_sector_t next;                /* Sector after last request. */
+  };
+
+/* A channel: a path to one or more devices that can serve only
+   one request at a time, such as an IDE channel.  Each channel
+   has a queue of pending requests and a worker thread that takes
+   requests off the queue, in the order chosen by the queue's
+   scheduler, and passes them to the driver.  Separate channels
+   serve their requests concurrently. */
+struct block_channel
+  {
+    struct list_elem list_elem;         /* Element in all_channels. */
+    char name[16];                      /* Channel name. */
+
+    struct lock lock;                   /* Protects the members below. */
+    struct condition not_empty;         /* Signaled when a request arrives. */
+    struct list requests;               /* Pending requests, oldest first. */
+    const struct block_scheduler *scheduler; /* Chooses next request. */
+    struct thread *worker;              /* Thread serving the queue. */
+
+    /* Statistics, in CPU cycles. */
+    unsigned depth;                     /* Requests queued or in service. */
+    unsigned max_depth;                 /* Maximum DEPTH. */
+    uint64_t depth_area;                /* Sum of DEPTH times its duration. */
+    uint64_t depth_changed;             /* When DEPTH last changed. */
+    uint64_t busy;                      /* Time spent in the driver. */
+    uint64_t created;                   /* When the channel was created. */
+  };
+
+/* An I/O scheduler. */
+struct block_scheduler
+  {
+    const char *name;                   /* Name, e.g. "clook". */
+
+    /* Returns the request to serve next from a nonempty queue,
+       without removing it.  Called with the queue's lock held. */
+    struct block_request *(*select) (struct block_channel *);
+  };
 
 /* A block device. */
 struct block
@@ -17,19 +87,77 @@ struct block
 
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
+    struct block_channel *channel;      /* Serves requests, if no map op. */
+    block_sector_t head;                /* Sector after last one served.
+                                           Protected by CHANNEL's lock. */
 
-    struct lock lock;                   /* Protects read_cnt and write_cnt. */
+    struct lock lock;                   /* Protects the members below. */
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+    struct block_stats stats;           /* Request statistics. */
   };
 
+/* An entry in the I/O trace. */
+struct trace_record
+  {
+    block_sector_t sector;              /* First sector, on ORIGIN. */
+    uint16_t sector_cnt;                /* Number of sectors. */
+    bool write;                         /* Write rather than read? */
+    int issuer;                         /* ID of submitting thread. */
+    uint64_t latency;                   /* Cycles from submit to complete. */
+    struct block *origin;               /* Device submitted to. */
+  };
+
+/* Number of pages and records in the I/O trace ring buffer. */
+#define TRACE_PAGES 32
+#define TRACE_RECORDS (TRACE_PAGES * PGSIZE / sizeof (struct trace_record))
+
+/* I/O trace, a ring buffer of the most recently completed
+   requests.  Allocated when the first request completes after
+   tracing has been enabled with block_trace_enable(). */
+static bool trace_enabled;
+static struct trace_record *trace;
+static size_t trace_cnt;                /* Records ever written. */
+static struct lock trace_lock;          /* Protects the trace. */
+
 /* List of all block devices. */
 static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 
+/* List of all channels. */
+static struct list all_channels = LIST_INITIALIZER (all_channels);
+
 /* The block block assigned to each Pintos role. */
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static void channel_add (struct block_channel *, struct block_request *);
+static void record_completion (struct block_request *, uint64_t now);
+static void driver_transfer (struct block *, block_sector_t,
+                             const struct block_iovec *, size_t, bool write);
+
+static struct block_request *fifo_select (struct block_channel *);
+static struct block_request *clook_select (struct block_channel *);
+static struct block_request *deadline_select (struct block_channel *);
+
+static const struct block_scheduler schedulers[] =
+  {
+    { "fifo", fifo_select },
+    { "clook", clook_select },
+    { "deadline", deadline_select },
+  };
+#define SCHEDULER_CNT (sizeof schedulers / sizeof *schedulers)
+
+/* Scheduler for devices registered from now on. */
+static const struct block_scheduler *default_scheduler = &schedulers[2];
+
+/* Returns the CPU's time stamp counter. */
+static inline uint64_t
+rdtsc (void)
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -101,18 +229,112 @@ block_get_by_name (const char *name)
   return NULL;
 }
 
-/* Verifies that SECTOR is a valid offset within BLOCK.
-   Panics if not. */
+/* Verifies that the CNT sectors starting at SECTOR lie within
+   BLOCK.  Panics if not. */
 static void
-check_sector (struct block *block, block_sector_t sector)
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
 {
-  if (sector >= block->size)
+  if (cnt > 0 && (sector >= block->size || cnt > block->size - sector))
+    PANIC ("Access past end of device %s (sectors=%"PRDSNu"...%"PRDSNu", "
+           "size=%"PRDSNu")\n", block_name (block), sector,
+           (block_sector_t) (sector + cnt - 1), block->size);
+}
+
+/* Returns the total number of sectors in the IOV_CNT elements of
+   IOV. */
+static size_t
+iovec_sectors (const struct block_iovec *iov, size_t iov_cnt)
+{
+  size_t cnt = 0;
+  size_t i;
+
+  for (i = 0; i < iov_cnt; i++)
+    cnt += iov[i].sector_cnt;
+  return cnt;
+}
+
+/* Submits request R to BLOCK and returns without waiting for it
+   to complete.  R->DONE is called, from BLOCK's worker thread,
+   once it has.  Requests to a device that maps onto another are
+   passed on to that device.  R must describe at least one
+   sector. */
+void
+block_submit (struct block *block, struct block_request *r)
+{
+  r->sector_cnt = iovec_sectors (r->iov, r->iov_cnt);
+  ASSERT (r->sector_cnt > 0);
+  ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+
+  r->origin = block;
+  r->issuer = thread_tid ();
+  r->submitted = rdtsc ();
+  for (;;)
+    {
+      check_sectors (block, r->sector, r->sector_cnt);
+      lock_acquire (&block->lock);
+      if (r->write)
+        block->write_cnt += r->sector_cnt;
+      else
+        block->read_cnt += r->sector_cnt;
+      if (block == r->origin)
+        {
+          struct block_stats *st = &block->stats;
+          st->request_cnt++;
+          if (r->sector == st->next)
+            st->sequential_cnt++;
+          st->next = r->sector + r->sector_cnt;
+        }
+      lock_release (&block->lock);
+
+      if (block->ops->map == NULL)
+        break;
+      block = block->ops->map (block->aux, &r->sector);
+    }
+
+  r->block = block;
+  if (block->channel->worker == thread_current ())
     {
-      /* We do not use ASSERT because we want to panic here
-         regardless of whether NDEBUG is defined. */
-      PANIC ("Access past end of device %s (sector=%"PRDSNu", "
-             "size=%"PRDSNu")\n", block_name (block), sector, block->size);
+      /* A request from the channel's own worker, for example
+         while it shuts the machine down after a driver panic,
+         would wait forever in the queue, so serve it now. */
+      r->dispatched = rdtsc ();
+      driver_transfer (block, r->sector, r->iov, r->iov_cnt, r->write);
+      record_completion (r, rdtsc ());
+      r->done (r, r->aux);
     }
+  else
+    channel_add (block->channel, r);
+}
+
+/* Completion callback for synchronous requests, whose AUX is a
+   semaphore that the submitter is waiting on. */
+static void
+sync_done (struct block_request *r UNUSED, void *done)
+{
+  sema_up (done);
+}
+
+/* Transfers consecutive sectors of BLOCK, starting at SECTOR, to
+   or from the IOV_CNT buffers in IOV, depending on WRITE, and
+   waits for the transfer to complete. */
+static void
+transfer_sync (struct block *block, block_sector_t sector,
+               const struct block_iovec *iov, size_t iov_cnt, bool write)
+{
+  struct block_request r;
+  struct semaphore done;
+
+  if (iovec_sectors (iov, iov_cnt) == 0)
+    return;
+  sema_init (&done, 0);
+  r.sector = sector;
+  r.iov = iov;
+  r.iov_cnt = iov_cnt;
+  r.write = write;
+  r.done = sync_done;
+  r.aux = &done;
+  block_submit (block, &r);
+  sema_down (&done);
 }
 
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
@@ -122,11 +344,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  lock_acquire (&block->lock);
-  block->read_cnt++;
-  lock_release (&block->lock);
+  block_read_multiple (block, sector, buffer, 1);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -137,12 +355,384 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  lock_acquire (&block->lock);
-  block->write_cnt++;
-  lock_release (&block->lock);
+  block_write_multiple (block, sector, buffer, 1);
+}
+
+/* Reads CNT sectors starting at SECTOR from BLOCK into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.  The
+   driver transfers them with as few commands as it can. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     void *buffer, size_t cnt)
+{
+  struct block_iovec iov;
+
+  iov.buffer = buffer;
+  iov.sector_cnt = cnt;
+  block_readv (block, sector, &iov, 1);
+}
+
+/* Writes CNT sectors starting at SECTOR to BLOCK from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns
+   after the block device has acknowledged receiving the data. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      const void *buffer, size_t cnt)
+{
+  struct block_iovec iov;
+
+  iov.buffer = (void *) buffer;
+  iov.sector_cnt = cnt;
+  block_writev (block, sector, &iov, 1);
+}
+
+/* Reads consecutive sectors of BLOCK, starting at SECTOR, into
+   the IOV_CNT buffers described by IOV, filling each in turn.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_readv (struct block *block, block_sector_t sector,
+             const struct block_iovec *iov, size_t iov_cnt)
+{
+  transfer_sync (block, sector, iov, iov_cnt, false);
+}
+
+/* Writes consecutive sectors of BLOCK, starting at SECTOR, from
+   the IOV_CNT buffers described by IOV, in turn.  Returns after
+   the block device has acknowledged receiving the data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_writev (struct block *block, block_sector_t sector,
+              const struct block_iovec *iov, size_t iov_cnt)
+{
+  transfer_sync (block, sector, iov, iov_cnt, true);
+}
+
+/* Channels. */
+
+/* Adds DELTA to the number of requests queued on or being served
+   by channel Q, keeping Q's statistics up to date. */
+static void
+change_depth (struct block_channel *q, int delta)
+{
+  uint64_t now = rdtsc ();
+
+  ASSERT (lock_held_by_current_thread (&q->lock));
+  q->depth_area += q->depth * (now - q->depth_changed);
+  q->depth_changed = now;
+  q->depth += delta;
+  if (q->depth > q->max_depth)
+    q->max_depth = q->depth;
+}
+
+/* Adds R to channel Q's queue and wakes Q's worker. */
+static void
+channel_add (struct block_channel *q, struct block_request *r)
+{
+  r->deadline = timer_ticks () + (r->write ? WRITE_DEADLINE : READ_DEADLINE);
+  lock_acquire (&q->lock);
+  list_push_back (&q->requests, &r->elem);
+  change_depth (q, 1);
+  cond_signal (&q->not_empty, &q->lock);
+  lock_release (&q->lock);
+}
+
+/* Returns the request after E in a queue, or a null pointer if E
+   is the last. */
+static struct block_request *
+next_request (struct block_channel *q, struct list_elem *e)
+{
+  e = list_next (e);
+  return e != list_end (&q->requests)
+         ? list_entry (e, struct block_request, elem) : NULL;
+}
+
+/* Removes the next request to serve from Q, as chosen by Q's
+   scheduler, together with pending requests for the sectors just
+   before and after it, so that they can be served by a single
+   driver call.  Stores the requests into BATCH in sector order
+   and returns their number.  Q must not be empty. */
+static size_t
+take_batch (struct block_channel *q, struct block_request *batch[])
+{
+  struct block_request *first = q->scheduler->select (q);
+  block_sector_t start = first->sector;
+  block_sector_t end = start + first->sector_cnt;
+  size_t iov_cnt = first->iov_cnt;
+  size_t cnt = 1;
+  bool merged;
+
+  ASSERT (lock_held_by_current_thread (&q->lock));
+
+  list_remove (&first->elem);
+  batch[0] = first;
+  do
+    {
+      struct list_elem *e;
+
+      merged = false;
+      for (e = list_begin (&q->requests); e != list_end (&q->requests);
+           e = list_next (e))
+        {
+          struct block_request *r = list_entry (e, struct block_request,
+                                                elem);
+          if (r->block != first->block || r->write != first->write
+              || cnt >= MERGE_MAX_REQUESTS
+              || iov_cnt + r->iov_cnt > MERGE_MAX_IOVS
+              || end - start + r->sector_cnt > MERGE_MAX_SECTORS)
+            continue;
+
+          if (r->sector == end)
+            {
+              batch[cnt++] = r;
+              end += r->sector_cnt;
+            }
+          else if (r->sector + r->sector_cnt == start)
+            {
+              memmove (batch + 1, batch, cnt++ * sizeof *batch);
+              batch[0] = r;
+              start = r->sector;
+            }
+          else
+            continue;
+
+          list_remove (e);
+          iov_cnt += r->iov_cnt;
+          merged = true;
+          break;
+        }
+    }
+  while (merged);
+
+  first->block->head = end;
+  return cnt;
+}
+
+/* Transfers the sectors described by IOV to or from BLOCK,
+   starting at SECTOR, using the driver's vectored operation if
+   it has one and one call per sector otherwise. */
+static void
+driver_transfer (struct block *block, block_sector_t sector,
+                 const struct block_iovec *iov, size_t iov_cnt, bool write)
+{
+  size_t i, j;
+
+  if (write && block->ops->writev != NULL)
+    block->ops->writev (block->aux, sector, iov, iov_cnt);
+  else if (!write && block->ops->readv != NULL)
+    block->ops->readv (block->aux, sector, iov, iov_cnt);
+  else
+    for (i = 0; i < iov_cnt; i++)
+      for (j = 0; j < iov[i].sector_cnt; j++)
+        {
+          uint8_t *buffer = (uint8_t *) iov[i].buffer + j * BLOCK_SECTOR_SIZE;
+          if (write)
+            block->ops->write (block->aux, sector++, buffer);
+          else
+            block->ops->read (block->aux, sector++, buffer);
+        }
+}
+
+/* Serves the requests queued on a channel, passed as CHANNEL_,
+   one batch at a time. */
+static void
+channel_worker (void *channel_)
+{
+  struct block_channel *q = channel_;
+
+  q->worker = thread_current ();
+  for (;;)
+    {
+      struct block_request *batch[MERGE_MAX_REQUESTS];
+      struct block_iovec merged_iov[MERGE_MAX_IOVS];
+      const struct block_iovec *iov;
+      size_t cnt, iov_cnt;
+      uint64_t start, end;
+      size_t i;
+
+      lock_acquire (&q->lock);
+      while (list_empty (&q->requests))
+        cond_wait (&q->not_empty, &q->lock);
+      cnt = take_batch (q, batch);
+      lock_release (&q->lock);
+
+      /* A lone request is passed to the driver as it is, since it
+         may have more than MERGE_MAX_IOVS iovecs.  take_batch()
+         merges requests only up to that many. */
+      if (cnt == 1)
+        {
+          iov = batch[0]->iov;
+          iov_cnt = batch[0]->iov_cnt;
+        }
+      else
+        {
+          iov_cnt = 0;
+          for (i = 0; i < cnt; i++)
+            {
+              memcpy (merged_iov + iov_cnt, batch[i]->iov,
+                      batch[i]->iov_cnt * sizeof *merged_iov);
+              iov_cnt += batch[i]->iov_cnt;
+            }
+          iov = merged_iov;
+        }
+      start = rdtsc ();
+      for (i = 0; i < cnt; i++)
+        batch[i]->dispatched = start;
+      driver_transfer (batch[0]->block, batch[0]->sector, iov, iov_cnt,
+                       batch[0]->write);
+      end = rdtsc ();
+
+      lock_acquire (&q->lock);
+      q->busy += end - start;
+      change_depth (q, -(int) cnt);
+      lock_release (&q->lock);
+
+      for (i = 0; i < cnt; i++)
+        {
+          record_completion (batch[i], end);
+          batch[i]->done (batch[i], batch[i]->aux);
+        }
+    }
+}
+
+/* Creates a channel with the given NAME, with its own request
+   queue and worker thread.  Drivers whose devices share a path
+   that can serve only one request at a time, such as the two
+   disks on an IDE channel, create one channel for them and pass
+   it to block_register_channel(). */
+struct block_channel *
+block_channel_create (const char *name)
+{
+  struct block_channel *q = malloc (sizeof *q);
+  if (q == NULL)
+    PANIC ("Failed to allocate memory for block channel");
+
+  strlcpy (q->name, name, sizeof q->name);
+  lock_init (&q->lock);
+  cond_init (&q->not_empty);
+  list_init (&q->requests);
+  q->scheduler = default_scheduler;
+  q->worker = NULL;
+  q->depth = q->max_depth = 0;
+  q->depth_area = q->busy = 0;
+  q->created = q->depth_changed = rdtsc ();
+  list_push_back (&all_channels, &q->list_elem);
+
+  if (thread_create (q->name, PRI_DEFAULT, channel_worker, q) == TID_ERROR)
+    PANIC ("Failed to start worker thread for block channel %s", q->name);
+  return q;
+}
+
+/* I/O schedulers.
+
+   A scheduler chooses which request in a queue to serve next.
+   Adjacent requests are merged with the chosen one regardless of
+   the scheduler. */
+
+/* Returns the request that has been waiting longest in Q. */
+static struct block_request *
+fifo_select (struct block_channel *q)
+{
+  return list_entry (list_front (&q->requests), struct block_request, elem);
+}
+
+/* Returns, among the requests in Q for the same device as the
+   oldest one, the one with the lowest sector at or after the end
+   of the last request served on that device, or the lowest
+   sector of all if there is none, so that the disk head sweeps
+   in one direction and then returns to the start (C-LOOK).
+   Sector numbers of different devices on one channel cannot be
+   compared, so each device has its own head position, and the
+   devices take turns in the order their requests arrived. */
+static struct block_request *
+clook_select (struct block_channel *q)
+{
+  struct block *block = fifo_select (q)->block;
+  struct block_request *ahead = NULL;
+  struct block_request *lowest = NULL;
+  struct block_request *r;
+
+  for (r = fifo_select (q); r != NULL; r = next_request (q, &r->elem))
+    {
+      if (r->block != block)
+        continue;
+      if (r->sector >= block->head
+          && (ahead == NULL || r->sector < ahead->sector))
+        ahead = r;
+      if (lowest == NULL || r->sector < lowest->sector)
+        lowest = r;
+    }
+  return ahead != NULL ? ahead : lowest;
+}
+
+/* Serves requests in C-LOOK order, except that a request that
+   has waited past its deadline is served first.  Reads have
+   shorter deadlines than writes, because a thread usually waits
+   for its reads. */
+static struct block_request *
+deadline_select (struct block_channel *q)
+{
+  struct block_request *oldest = fifo_select (q);
+  struct block_request *r;
+
+  /* Requests are queued in arrival order, but reads and writes
+     have different deadlines, so check them all. */
+  for (r = oldest; r != NULL; r = next_request (q, &r->elem))
+    if (timer_ticks () >= r->deadline)
+      return r;
+  return clook_select (q);
+}
+
+/* Returns the scheduler with the given NAME, or a null pointer
+   if there is none. */
+static const struct block_scheduler *
+find_scheduler (const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < SCHEDULER_CNT; i++)
+    if (!strcmp (schedulers[i].name, name))
+      return &schedulers[i];
+  return NULL;
+}
+
+/* Makes the queue of the channel that serves BLOCK use the
+   scheduler named NAME, which may be "fifo", "clook" or
+   "deadline".  This affects every device on the channel,
+   including the device that BLOCK maps onto, if any.  Returns
+   true if successful, false if NAME is not a known scheduler. */
+bool
+block_set_scheduler (struct block *block, const char *name)
+{
+  const struct block_scheduler *s = find_scheduler (name);
+  struct block_channel *q;
+  block_sector_t sector = 0;
+
+  if (s == NULL)
+    return false;
+  while (block->ops->map != NULL)
+    block = block->ops->map (block->aux, &sector);
+  q = block->channel;
+  lock_acquire (&q->lock);
+  q->scheduler = s;
+  lock_release (&q->lock);
+  return true;
+}
+
+/* Makes devices registered from now on use the scheduler named
+   NAME.  May be called before the thread system is initialized.
+   Returns true if successful, false if NAME is not a known
+   scheduler. */
+bool
+block_set_default_scheduler (const char *name)
+{
+  const struct block_scheduler *s = find_scheduler (name);
+
+  if (s == NULL)
+    return false;
+  default_scheduler = s;
+  return true;
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -166,35 +756,235 @@ block_type (struct block *block)
   return block->type;
 }
 
-/* Prints statistics for each block device used for a Pintos role. */
+/* Returns the base-2 logarithm of X, rounded down, or 0 if X is
+   0, but no more than MAX. */
+static size_t
+log2_bucket (uint64_t x, size_t max)
+{
+  size_t b = 0;
+
+  while (x > 1 && b < max)
+    {
+      x >>= 1;
+      b++;
+    }
+  return b;
+}
+
+/* Records statistics about request R, which completed at CPU
+   cycle count NOW, on the device it was submitted to, and adds
+   it to the I/O trace if tracing is enabled. */
+static void
+record_completion (struct block_request *r, uint64_t now)
+{
+  struct block_stats *st = &r->origin->stats;
+  uint64_t latency = now - r->submitted;
+
+  lock_acquire (&r->origin->lock);
+  st->latency[log2_bucket (latency, LATENCY_BUCKETS - 1)]++;
+  st->wait[log2_bucket (r->dispatched - r->submitted,
+                        LATENCY_BUCKETS - 1)]++;
+  st->service[log2_bucket (now - r->dispatched, LATENCY_BUCKETS - 1)]++;
+  st->size[log2_bucket (r->sector_cnt, SIZE_BUCKETS - 1)]++;
+  lock_release (&r->origin->lock);
+
+  if (trace_enabled)
+    {
+      lock_acquire (&trace_lock);
+      if (trace == NULL)
+        {
+          trace = palloc_get_multiple (0, TRACE_PAGES);
+          if (trace == NULL)
+            {
+              printf ("block: not enough memory for I/O trace\n");
+              trace_enabled = false;
+            }
+        }
+      if (trace != NULL)
+        {
+          struct trace_record *t = &trace[trace_cnt++ % TRACE_RECORDS];
+          t->sector = r->sector;
+          t->sector_cnt = r->sector_cnt;
+          t->write = r->write;
+          t->issuer = r->issuer;
+          t->latency = latency;
+          t->origin = r->origin;
+        }
+      lock_release (&trace_lock);
+    }
+}
+
+/* Prints histogram H, which has CNT log2 buckets, on one line
+   after TITLE, omitting empty buckets.  Bucket B counts values
+   from 2**B to 2**(B+1) - 1, or from 0 to 1 for bucket 0. */
+static void
+print_histogram (const char *title, const unsigned long long *h, size_t cnt)
+{
+  size_t i;
+
+  printf ("  %s:", title);
+  for (i = 0; i < cnt; i++)
+    if (h[i] != 0)
+      printf (" %s%llu:%llu", i == cnt - 1 ? ">=" : "", 1ULL << i, h[i]);
+  printf ("\n");
+}
+
+/* Prints statistics for each block device used for a Pintos role:
+   the number of sectors read and written, the fraction of
+   requests that started where the previous one ended, and
+   histograms of request size and of latency, in CPU cycles,
+   split into time spent waiting in the queue and time spent
+   being served by the driver.  Then prints statistics for each
+   channel: the average and maximum number of requests queued on
+   or being served by it, and the fraction of time it spent
+   serving requests. */
 void
 block_print_stats (void)
 {
+  struct list_elem *e;
   int i;
 
-  for (i = 0; i < BLOCK_CNT; i++)
+  for (i = 0; i < BLOCK_ROLE_CNT; i++)
     {
       struct block *block = block_by_role[i];
       if (block != NULL)
         {
+          struct block_stats *st = &block->stats;
+          unsigned long long seq_x1000;
+
           lock_acquire (&block->lock);
-          printf ("%s (%s): %llu reads, %llu writes\n",
+          seq_x1000 = (st->request_cnt > 0
+                       ? st->sequential_cnt * 1000 / st->request_cnt : 0);
+          printf ("%s (%s): %llu reads, %llu writes, %llu requests, "
+                  "%llu.%llu%% sequential\n",
                   block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+                  block->read_cnt, block->write_cnt, st->request_cnt,
+                  seq_x1000 / 10, seq_x1000 % 10);
+          if (st->request_cnt > 0)
+            {
+              print_histogram ("sectors", st->size, SIZE_BUCKETS);
+              print_histogram ("latency", st->latency, LATENCY_BUCKETS);
+              print_histogram ("queued", st->wait, LATENCY_BUCKETS);
+              print_histogram ("service", st->service, LATENCY_BUCKETS);
+            }
           lock_release (&block->lock);
         }
     }
+
+  for (e = list_begin (&all_channels); e != list_end (&all_channels);
+       e = list_next (e))
+    {
+      struct block_channel *q = list_entry (e, struct block_channel,
+                                            list_elem);
+      uint64_t elapsed, depth_x100, busy_x1000;
+
+      lock_acquire (&q->lock);
+      change_depth (q, 0);
+      elapsed = q->depth_changed - q->created;
+      if (elapsed == 0)
+        elapsed = 1;
+      depth_x100 = q->depth_area * 100 / elapsed;
+      busy_x1000 = q->busy * 1000 / elapsed;
+      printf ("%s (%s): queue depth %llu.%02llu average, %u maximum, "
+              "%llu.%llu%% busy\n", q->name, q->scheduler->name,
+              depth_x100 / 100, depth_x100 % 100, q->max_depth,
+              busy_x1000 / 10, busy_x1000 % 10);
+      lock_release (&q->lock);
+    }
+}
+
+/* Starts recording each completed request in the I/O trace,
+   which keeps the most recent TRACE_RECORDS requests.  May be
+   called before the thread system is initialized. */
+void
+block_trace_enable (void)
+{
+  lock_init (&trace_lock);
+  trace_enabled = true;
+}
+
+/* Stops tracing and writes the I/O trace to the scratch device
+   as text, one request per line, oldest first, padded with null
+   bytes to a sector boundary.  Each line gives the device, "R"
+   or "W", the first sector, the number of sectors, the ID of the
+   thread that submitted the request, and its latency in CPU
+   cycles.  Lines that do not fit on the scratch device are
+   dropped.  Does nothing if there is no trace or no scratch
+   device. */
+void
+block_trace_dump (void)
+{
+  struct block *scratch = block_get_role (BLOCK_SCRATCH);
+  char *buffer;
+  block_sector_t sector = 0;
+  size_t ofs = 0;
+  size_t i, first;
+
+  if (trace == NULL || scratch == NULL)
+    return;
+  lock_acquire (&trace_lock);
+  trace_enabled = false;
+  lock_release (&trace_lock);
+
+  buffer = palloc_get_page (PAL_ZERO);
+  if (buffer == NULL)
+    return;
+  first = trace_cnt > TRACE_RECORDS ? trace_cnt - TRACE_RECORDS : 0;
+  for (i = first; i < trace_cnt && sector < block_size (scratch); i++)
+    {
+      const struct trace_record *t = &trace[i % TRACE_RECORDS];
+      char line[80];
+      size_t len, copied;
+
+      len = snprintf (line, sizeof line, "%s %c %"PRDSNu" %u %d %llu\n",
+                      t->origin->name, t->write ? 'W' : 'R', t->sector,
+                      (unsigned) t->sector_cnt, t->issuer,
+                      (unsigned long long) t->latency);
+      for (copied = 0; copied < len; copied++)
+        {
+          buffer[ofs++] = line[copied];
+          if (ofs == BLOCK_SECTOR_SIZE)
+            {
+              block_write (scratch, sector++, buffer);
+              memset (buffer, 0, BLOCK_SECTOR_SIZE);
+              ofs = 0;
+              if (sector >= block_size (scratch))
+                break;
+            }
+        }
+    }
+  if (ofs > 0 && sector < block_size (scratch))
+    block_write (scratch, sector++, buffer);
+  printf ("%s: %zu I/O trace records written to %"PRDSNu" sectors\n",
+          scratch->name, trace_cnt - first, sector);
+  palloc_free_page (buffer);
 }
 
 /* Registers a new block device with the given NAME.  If
    EXTRA_INFO is non-null, it is printed as part of a user
    message.  The block device's SIZE in sectors and its TYPE must
    be provided, as well as the it operation functions OPS, which
-   will be passed AUX in each function call. */
+   will be passed AUX in each function call.  Unless OPS maps the
+   device onto another one, the device gets a channel of its
+   own. */
 struct block *
 block_register (const char *name, enum block_type type,
                 const char *extra_info, block_sector_t size,
                 const struct block_operations *ops, void *aux)
+{
+  return block_register_channel (name, type, extra_info, size, ops, aux,
+                                 NULL);
+}
+
+/* Registers a new block device, as block_register(), whose
+   requests are served by CHANNEL.  If CHANNEL is null and OPS
+   does not map the device onto another one, a channel is created
+   for the device. */
+struct block *
+block_register_channel (const char *name, enum block_type type,
+                        const char *extra_info, block_sector_t size,
+                        const struct block_operations *ops, void *aux,
+                        struct block_channel *channel)
 {
   struct block *block = malloc (sizeof *block);
   if (block == NULL)
@@ -208,7 +998,13 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  memset (&block->stats, 0, sizeof block->stats);
   lock_init (&block->lock);
+  block->channel = NULL;
+  block->head = 0;
+  if (ops->map == NULL)
+    block->channel = (channel != NULL
+                      ? channel : block_channel_create (block->name));
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
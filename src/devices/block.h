@@ -1,8 +1,10 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -22,6 +24,14 @@ typedef uint32_t block_sector_t;
 
 struct block;
 
+/* One piece of a scatter-gather transfer: SECTOR_CNT sectors
+   held back to back in memory at BUFFER. */
+struct block_iovec
+  {
+    void *buffer;                /* Data, SECTOR_CNT * BLOCK_SECTOR_SIZE bytes. */
+    size_t sector_cnt;           /* Number of sectors. */
+  };
+
 /* Type of a block device. */
 enum block_type
   {
@@ -53,22 +63,95 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, void *, size_t cnt);
+void block_write_multiple (struct block *, block_sector_t, const void *,
+                           size_t cnt);
+void block_readv (struct block *, block_sector_t,
+                  const struct block_iovec *, size_t iov_cnt);
+void block_writev (struct block *, block_sector_t,
+                   const struct block_iovec *, size_t iov_cnt);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
-/* Statistics. */
+/* Asynchronous requests. */
+
+struct block_request;
+
+/* Called when request R completes, with the AUX it was
+   submitted with.  Runs in the device's worker thread. */
+typedef void block_done_func (struct block_request *r, void *aux);
+
+/* A request to transfer consecutive sectors to or from a block
+   device.  The submitter fills in the members above the line and
+   must leave the request and the buffers it describes alone
+   until DONE is called. */
+struct block_request
+  {
+    block_sector_t sector;              /* First sector. */
+    const struct block_iovec *iov;      /* Buffers. */
+    size_t iov_cnt;                     /* Number of elements in IOV. */
+    bool write;                         /* Write rather than read? */
+    block_done_func *done;              /* Completion callback. */
+    void *aux;                          /* Passed to DONE. */
+
+    /* ------------------------------------------------------------ */
+    /* Owned by the block layer. */
+    struct list_elem elem;              /* Element in a device queue. */
+    struct block *origin;               /* Device it was submitted to. */
+    struct block *block;                /* Device that will serve it. */
+    size_t sector_cnt;                  /* Number of sectors. */
+    int64_t deadline;                   /* Timer tick to serve it by. */
+    int issuer;                         /* ID of submitting thread. */
+    uint64_t submitted;                 /* CPU cycle count at submission. */
+    uint64_t dispatched;                /* CPU cycle count at dispatch. */
+  };
+
+void block_submit (struct block *, struct block_request *);
+
+/* I/O schedulers. */
+bool block_set_scheduler (struct block *, const char *name);
+bool block_set_default_scheduler (const char *name);
+
+/* Statistics and tracing. */
 void block_print_stats (void);
+void block_trace_enable (void);
+void block_trace_dump (void);
 
 /* Lower-level interface to block device drivers. */
 
+/* Driver operations.  READ and WRITE transfer a single sector
+   and are required.  READV and WRITEV transfer the sectors
+   described by an array of IOV_CNT iovecs, starting at the given
+   sector, as few commands as possible; drivers that leave them
+   null get one READ or WRITE call per sector.
+
+   Devices that are windows onto another device, such as
+   partitions, instead provide MAP, which translates *SECTOR in
+   place and returns the device that holds it.  Requests to such
+   devices are passed on to the queue of that device; the other
+   operations are not used.  Every other device gets a request
+   queue and a worker thread that calls its operations. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+    void (*readv) (void *aux, block_sector_t,
+                   const struct block_iovec *, size_t iov_cnt);
+    void (*writev) (void *aux, block_sector_t,
+                    const struct block_iovec *, size_t iov_cnt);
+    struct block *(*map) (void *aux, block_sector_t *sector);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
 
+struct block_channel;
+struct block_channel *block_channel_create (const char *name);
+struct block *block_register_channel (const char *name, enum block_type,
+                                      const char *extra_info,
+                                      block_sector_t size,
+                                      const struct block_operations *,
+                                      void *aux, struct block_channel *);
+
 #endif /* devices/block.h */
@@ -3,15 +3,20 @@
 #include <debug.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3], plus the
+   48-bit addressing feature set of later standards. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -30,10 +35,28 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE register port addresses, found through the
+   controller's PCI function.  Only present if bm_base is
+   nonzero. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0)  /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)   /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)     /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits. */
+#define BM_ST_ACTIVE 0x01       /* Transfer in progress. */
+#define BM_ST_ERROR 0x02        /* Transfer failed (write 1 to clear). */
+#define BM_ST_INTR 0x04         /* Disk interrupted (write 1 to clear). */
+#define BM_ST_DRV_DMA 0x60      /* Drives 0 and 1 are DMA capable. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +72,24 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_SECTOR_EXT 0x24        /* READ SECTOR EXT. */
+#define CMD_WRITE_SECTOR_EXT 0x34       /* WRITE SECTOR EXT. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_READ_MULTIPLE_EXT 0x29      /* READ MULTIPLE EXT. */
+#define CMD_WRITE_MULTIPLE_EXT 0x39     /* WRITE MULTIPLE EXT. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+#define CMD_READ_DMA_EXT 0x25           /* READ DMA EXT. */
+#define CMD_WRITE_DMA_EXT 0x35          /* WRITE DMA EXT. */
+
+/* Maximum number of sectors transferred by one command.  Both
+   28-bit and 48-bit commands can express this count. */
+#define MAX_SECTORS_PER_COMMAND 256
+
+/* Sectors addressable with 28-bit LBA commands. */
+#define LBA28_SECTORS (1UL << 28)
 
 /* An ATA device. */
 struct ata_disk
@@ -57,8 +98,28 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    bool lba48;                 /* Supports 48-bit LBA commands? */
+    int multiple;               /* Sectors per READ/WRITE MULTIPLE
+                                   data block, or 0 if not enabled. */
+    bool dma;                   /* Transfer data by bus master DMA? */
+  };
+
+/* A bus master IDE physical region descriptor, which describes
+   one physically contiguous piece of a DMA transfer.  A region
+   may not cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Size in bytes, with 0 meaning 64 kB. */
+    uint16_t flags;             /* PRD_EOT in the last descriptor. */
   };
 
+/* PRD flags. */
+#define PRD_EOT 0x8000          /* End of table. */
+
+/* Number of descriptors that fit in a channel's PRD table. */
+#define PRD_CNT (PGSIZE / sizeof (struct prd))
+
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
 struct channel
@@ -68,10 +129,15 @@ struct channel
     uint8_t irq;                /* Interrupt in use. */
 
     struct lock lock;           /* Must acquire to access the controller. */
+    struct block_channel *queue; /* Serves requests to both devices. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base port, or 0 if none. */
+    struct prd *prdt;           /* PRD table, one page. */
+    uint8_t bm_status;          /* Bus master status at last interrupt. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -81,11 +147,12 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+static uint16_t find_bus_master (void);
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -102,6 +169,7 @@ void
 ide_init (void) 
 {
   size_t chan_no;
+  uint16_t bm_base = find_bus_master ();
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
@@ -124,8 +192,20 @@ ide_init (void)
           NOT_REACHED ();
         }
       lock_init (&c->lock);
+      c->queue = NULL;
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+
+      /* Prepare for DMA, if there is a bus master IDE function.
+         Each channel has 8 bus master ports. */
+      c->bm_base = 0;
+      c->prdt = NULL;
+      if (bm_base != 0)
+        {
+          c->prdt = palloc_get_page (0);
+          if (c->prdt != NULL)
+            c->bm_base = bm_base + chan_no * 8;
+        }
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +216,9 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->lba48 = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -157,7 +240,37 @@ ide_init (void)
 
 /* Disk detection and identification. */
 
+/* Returns the base I/O port of the PCI bus master IDE function
+   that drives the legacy channels, such as the PIIX's, or 0 if
+   there is none.  Enables the function's bus mastering. */
+static uint16_t
+find_bus_master (void)
+{
+  /* Programming interfaces of IDE controllers with bus master
+     support (bit 7), in compatibility or native mode. */
+  static const int ifaces[] = { 0x80, 0x8a, 0x8f };
+  size_t i;
+
+  for (i = 0; i < sizeof ifaces / sizeof *ifaces; i++)
+    {
+      struct pci_dev *pd = pci_get_dev_by_class (PCI_MAJOR_MASS_STORAGE,
+                                                 PCI_MINOR_IDE, ifaces[i], 0);
+      if (pd != NULL)
+        {
+          /* The bus master registers are at BAR 4. */
+          uint32_t bar = pci_read_config32 (pd, PCI_MAPREG_START + 4 * 4);
+          if (PCI_MAPREG_TYPE (bar) != PCI_MAPREG_TYPE_IO
+              || PCI_MAPREG_IO_ADDR (bar) == 0)
+            continue;
+          pci_enable (pd);
+          return PCI_MAPREG_IO_ADDR (bar);
+        }
+    }
+  return 0;
+}
+
 static char *descramble_ata_string (char *, int size);
+static void set_multiple_mode (struct ata_disk *, int cnt);
 
 /* Resets an ATA channel and waits for any devices present on it
    to finish the reset. */
@@ -281,34 +394,82 @@ identify_ata_device (struct ata_disk *d)
     }
   input_sector (c, id);
 
-  /* Calculate capacity.
+  /* Calculate capacity, which is in words 100 through 103 for
+     disks that support 48-bit addressing (word 83, bit 10) and
+     in words 60 and 61 otherwise.  Sectors past what a
+     block_sector_t can address are not used.
      Read model name and serial number. */
-  capacity = *(uint32_t *) &id[60 * 2];
+  d->lba48 = (*(uint16_t *) &id[83 * 2] & (1 << 10)) != 0;
+  if (d->lba48)
+    {
+      uint64_t lba48_capacity = *(uint64_t *) &id[100 * 2];
+      capacity = (lba48_capacity > UINT32_MAX
+                  ? UINT32_MAX : (block_sector_t) lba48_capacity);
+    }
+  else
+    capacity = *(uint32_t *) &id[60 * 2];
+  /* Enable READ/WRITE MULTIPLE with the largest data block the
+     disk supports, from the low byte of word 47.  Use DMA instead
+     if both the disk (word 49, bit 8) and the channel support
+     it; PIO remains the fallback. */
+  set_multiple_mode (d, (uint8_t) id[47 * 2]);
+  d->dma = (c->bm_base != 0
+            && (*(uint16_t *) &id[49 * 2] & (1 << 8)) != 0);
+
   model = descramble_ata_string (&id[10 * 2], 20);
   serial = descramble_ata_string (&id[27 * 2], 40);
   snprintf (extra_info, sizeof extra_info,
-            "model \"%s\", serial \"%s\"", model, serial);
+            "model \"%s\", serial \"%s\"%s", model, serial,
+            d->dma ? ", DMA" : "");
 
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
      allow access to those, we're less likely to scribble on
-     someone's important data.  You can disable this check by
-     hand if you really want to do so. */
-  if (capacity >= 1024 * 1024 * 1024 / BLOCK_SECTOR_SIZE)
+     someone's important data.  Disks emulated by QEMU are
+     exempt, so that large swap and data disks can be attached.
+     You can disable this check by hand if you really want to
+     do so. */
+  if (capacity >= 1024 * 1024 * 1024 / BLOCK_SECTOR_SIZE
+      && memcmp (model, "QEMU", 4))
     {
       printf ("%s: ignoring ", d->name);
-      print_human_readable_size (capacity * 512);
+      print_human_readable_size ((uint64_t) capacity * BLOCK_SECTOR_SIZE);
       printf ("disk for safety\n");
       d->is_ata = false;
       return;
     }
 
-  /* Register. */
-  block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
-                          &ide_operations, d);
+  /* Register.  The disks on a channel share its request queue,
+     since the channel serves one command at a time. */
+  if (c->queue == NULL)
+    c->queue = block_channel_create (c->name);
+  block = block_register_channel (d->name, BLOCK_RAW, extra_info, capacity,
+                                  &ide_operations, d, c->queue);
   partition_scan (block);
 }
 
+/* Sends a SET MULTIPLE MODE command to disk D, asking it to
+   transfer CNT sectors per data block in READ MULTIPLE and WRITE
+   MULTIPLE commands.  Records the setting in D if the disk
+   accepts it. */
+static void
+set_multiple_mode (struct ata_disk *d, int cnt)
+{
+  struct channel *c = d->channel;
+
+  d->multiple = 0;
+  if (cnt <= 1)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_alt_status (c)) & STA_ERR) == 0)
+    d->multiple = cnt;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,25 +498,236 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* A position within an array of iovecs. */
+struct iov_pos
+  {
+    const struct block_iovec *iov;      /* Current iovec. */
+    size_t sector;                      /* Sector within *IOV. */
+  };
+
+/* Returns the buffer for the next sector at P and advances P
+   past it. */
+static uint8_t *
+iov_next (struct iov_pos *p)
+{
+  uint8_t *buffer;
+
+  while (p->sector >= p->iov->sector_cnt)
+    {
+      p->iov++;
+      p->sector = 0;
+    }
+  buffer = (uint8_t *) p->iov->buffer + p->sector * BLOCK_SECTOR_SIZE;
+  p->sector++;
+  return buffer;
+}
+
+/* Chooses the command for transferring CNT sectors starting at
+   SEC_NO on disk D, in direction WRITE, and stores the number of
+   sectors it moves per data block in *BLOCK_CNT. */
+static uint8_t
+choose_command (const struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+                bool write, size_t *block_cnt)
+{
+  bool ext = sec_no + cnt > LBA28_SECTORS;
+
+  if (d->multiple > 1 && cnt > 1)
+    {
+      *block_cnt = d->multiple;
+      if (ext)
+        return write ? CMD_WRITE_MULTIPLE_EXT : CMD_READ_MULTIPLE_EXT;
+      else
+        return write ? CMD_WRITE_MULTIPLE : CMD_READ_MULTIPLE;
+    }
+  else
+    {
+      *block_cnt = 1;
+      if (ext)
+        return write ? CMD_WRITE_SECTOR_EXT : CMD_READ_SECTOR_EXT;
+      else
+        return write ? CMD_WRITE_SECTOR_RETRY : CMD_READ_SECTOR_RETRY;
+    }
+}
+
+/* Transfers the CNT sectors starting at SEC_NO on disk D to or
+   from the buffers at P, depending on WRITE, with a single PIO
+   command.  CNT must not exceed MAX_SECTORS_PER_COMMAND.
+
+   The disk raises one interrupt per data block, which holds up
+   to D->multiple sectors in READ/WRITE MULTIPLE mode and one
+   sector otherwise.  When reading, each interrupt announces a
+   block ready to be read; when writing, the first block is sent
+   as soon as the disk asks for data and each interrupt asks for
+   the next one, with a final interrupt once all of the data has
+   been written.
+   The caller must hold D's channel lock. */
+static void
+pio_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              struct iov_pos *p, bool write)
+{
+  struct channel *c = d->channel;
+  size_t block_cnt;
+  uint8_t command = choose_command (d, sec_no, cnt, write, &block_cnt);
+  size_t done = 0;
+
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_COMMAND);
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, command);
+  while (done < cnt)
+    {
+      size_t n = cnt - done < block_cnt ? cnt - done : block_cnt;
+
+      if (!write || done > 0)
+        sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk %s failed, sector=%"PRDSNu, d->name,
+               write ? "write" : "read", sec_no + done);
+      for (; n > 0; n--, done++)
+        {
+          if (write)
+            output_sector (c, iov_next (p));
+          else
+            input_sector (c, iov_next (p));
+        }
+    }
+  if (write)
+    sema_down (&c->completion_wait);
+}
+
+/* Adds the SIZE bytes at kernel virtual address BUFFER to the
+   PRD_CNT descriptors in channel C's PRD table, extending the
+   last descriptor where possible and splitting the region at
+   64 kB boundaries.  Returns the new number of descriptors. */
+static size_t
+add_prd_region (struct channel *c, size_t prd_cnt, const void *buffer,
+                size_t size)
+{
+  uintptr_t addr = vtop (buffer);
+
+  while (size > 0)
+    {
+      size_t boundary_left = 0x10000 - (addr & 0xffff);
+      size_t chunk = size < boundary_left ? size : boundary_left;
+      struct prd *last = prd_cnt > 0 ? &c->prdt[prd_cnt - 1] : NULL;
+
+      /* A descriptor's size of 0 means 64 kB, which can only be
+         reached at a 64 kB boundary, so such a descriptor is
+         never extended. */
+      if (last != NULL && last->size != 0
+          && last->addr + last->size == addr
+          && (addr & 0xffff) != 0)
+        last->size += chunk;
+      else
+        {
+          ASSERT (prd_cnt < PRD_CNT);
+          last = &c->prdt[prd_cnt++];
+          last->addr = addr;
+          last->size = chunk;
+          last->flags = 0;
+        }
+
+      addr += chunk;
+      size -= chunk;
+    }
+  return prd_cnt;
+}
+
+/* Transfers the CNT sectors starting at SEC_NO on disk D to or
+   from the buffers at P, depending on WRITE, with a single bus
+   master DMA command.  CNT must not exceed
+   MAX_SECTORS_PER_COMMAND.  The controller moves the data while
+   the CPU runs other threads, and the disk interrupts once when
+   the whole transfer is complete.
+   The caller must hold D's channel lock. */
+static void
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              struct iov_pos *p, bool write)
+{
+  struct channel *c = d->channel;
+  bool ext = sec_no + cnt > LBA28_SECTORS;
+  uint8_t direction = write ? 0 : BM_CMD_READ;
+  uint8_t command;
+  size_t prd_cnt = 0;
+  size_t i;
+
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_COMMAND);
+
+  if (write)
+    command = ext ? CMD_WRITE_DMA_EXT : CMD_WRITE_DMA;
+  else
+    command = ext ? CMD_READ_DMA_EXT : CMD_READ_DMA;
+
+  /* Describe the buffers to the controller. */
+  for (i = 0; i < cnt; i++)
+    prd_cnt = add_prd_region (c, prd_cnt, iov_next (p), BLOCK_SECTOR_SIZE);
+  c->prdt[prd_cnt - 1].flags = PRD_EOT;
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), direction);
+  outb (reg_bm_status (c), ((inb (reg_bm_status (c)) & BM_ST_DRV_DMA)
+                            | BM_ST_ERROR | BM_ST_INTR));
+
+  /* Start the disk, then the controller, and wait for the
+     completion interrupt. */
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, command);
+  outb (reg_bm_command (c), direction | BM_CMD_START);
+  sema_down (&c->completion_wait);
+  outb (reg_bm_command (c), direction);
+
+  if ((c->bm_status & BM_ST_ERROR) != 0
+      || (inb (reg_alt_status (c)) & STA_ERR) != 0)
+    PANIC ("%s: disk %s failed, sector=%"PRDSNu, d->name,
+           write ? "write" : "read", sec_no);
+}
+
+/* Transfers consecutive sectors of disk D, starting at SEC_NO, to
+   or from the IOV_CNT buffers in IOV, depending on WRITE, using
+   as few commands as possible.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_transfer_iov (struct ata_disk *d, block_sector_t sec_no,
+                  const struct block_iovec *iov, size_t iov_cnt, bool write)
 {
-  struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  struct iov_pos p;
+  size_t cnt = 0;
+  size_t i;
+
+  for (i = 0; i < iov_cnt; i++)
+    cnt += iov[i].sector_cnt;
+  p.iov = iov;
+  p.sector = 0;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_SECTORS_PER_COMMAND ? cnt : MAX_SECTORS_PER_COMMAND;
+      if (d->dma)
+        dma_transfer (d, sec_no, n, &p, write);
+      else
+        pio_transfer (d, sec_no, n, &p, write);
+      sec_no += n;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
 
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read (void *d_, block_sector_t sec_no, void *buffer)
+{
+  struct block_iovec iov;
+
+  iov.buffer = buffer;
+  iov.sector_cnt = 1;
+  ide_transfer_iov (d_, sec_no, &iov, 1, false);
+}
+
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
    BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
    acknowledged receiving the data.
@@ -364,41 +736,77 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
 static void
 ide_write (void *d_, block_sector_t sec_no, const void *buffer)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  struct block_iovec iov;
+
+  iov.buffer = (void *) buffer;
+  iov.sector_cnt = 1;
+  ide_transfer_iov (d_, sec_no, &iov, 1, true);
+}
+
+/* Reads consecutive sectors of disk D, starting at SEC_NO, into
+   the IOV_CNT buffers in IOV. */
+static void
+ide_readv (void *d_, block_sector_t sec_no,
+           const struct block_iovec *iov, size_t iov_cnt)
+{
+  ide_transfer_iov (d_, sec_no, iov, iov_cnt, false);
+}
+
+/* Writes consecutive sectors of disk D, starting at SEC_NO, from
+   the IOV_CNT buffers in IOV.  Returns after the disk has
+   acknowledged receiving all of the data. */
+static void
+ide_writev (void *d_, block_sector_t sec_no,
+            const struct block_iovec *iov, size_t iov_cnt)
+{
+  ide_transfer_iov (d_, sec_no, iov, iov_cnt, true);
 }
 
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_readv,
+    ide_writev,
+    NULL
   };
-
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the sector count CNT to the disk's sector
+   selection registers.  (We use LBA mode.)  Requests that reach
+   past the first 2**28 sectors use 48-bit addressing, which
+   takes two writes to each register, high-order byte first. */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
+  uint8_t dev = DEV_MBS | DEV_LBA | (d->dev_no == 1 ? DEV_DEV : 0);
+
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_COMMAND);
 
-  ASSERT (sec_no < (1UL << 28));
-  
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
-  outb (reg_lbal (c), sec_no);
-  outb (reg_lbam (c), sec_no >> 8);
-  outb (reg_lbah (c), (sec_no >> 16));
-  outb (reg_device (c),
-        DEV_MBS | DEV_LBA | (d->dev_no == 1 ? DEV_DEV : 0) | (sec_no >> 24));
+  if (sec_no + cnt > LBA28_SECTORS)
+    {
+      ASSERT (d->lba48);
+      outb (reg_nsect (c), cnt >> 8);
+      outb (reg_lbal (c), sec_no >> 24);
+      outb (reg_lbam (c), 0);
+      outb (reg_lbah (c), 0);
+      outb (reg_nsect (c), cnt);
+      outb (reg_lbal (c), sec_no);
+      outb (reg_lbam (c), sec_no >> 8);
+      outb (reg_lbah (c), sec_no >> 16);
+      outb (reg_device (c), dev);
+    }
+  else
+    {
+      /* A count of 256 is written as 0. */
+      outb (reg_nsect (c), cnt);
+      outb (reg_lbal (c), sec_no);
+      outb (reg_lbam (c), sec_no >> 8);
+      outb (reg_lbah (c), sec_no >> 16);
+      outb (reg_device (c), dev | (sec_no >> 24));
+    }
 }
 
 /* Writes COMMAND to channel C and prepares for receiving a
@@ -514,6 +922,15 @@ interrupt_handler (struct intr_frame *f)
         if (c->expecting_interrupt) 
           {
             inb (reg_status (c));               /* Acknowledge interrupt. */
+            if (c->bm_base != 0)
+              {
+                /* Save the DMA status for the waiter and clear
+                   the bus master interrupt bit, preserving the
+                   drives' DMA capable bits. */
+                c->bm_status = inb (reg_bm_status (c));
+                outb (reg_bm_status (c),
+                      (c->bm_status & BM_ST_DRV_DMA) | BM_ST_INTR);
+              }
             sema_up (&c->completion_wait);      /* Wake up waiter. */
           }
         else
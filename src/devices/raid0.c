@@ -0,0 +1,240 @@
+#include "devices/raid0.h"
+#include <debug.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* A RAID-0 array, which stripes its sectors across several
+   member devices: the first STRIPE sectors are on the first
+   member, the next STRIPE on the second member, and so on,
+   wrapping around to the first member after the last.
+
+   Each part of a request that falls on one member is submitted
+   to that member's queue, so that members on different channels
+   work on a request at the same time.  Within a request, all the
+   parts that fall on one member are consecutive on that member,
+   so each member gets at most one request. */
+
+/* Maximum number of member devices. */
+#define MAX_MEMBERS 8
+
+/* A RAID-0 array. */
+struct raid0
+  {
+    struct block *members[MAX_MEMBERS]; /* Member devices. */
+    size_t member_cnt;                  /* Number of members. */
+    block_sector_t stripe;              /* Sectors per stripe unit. */
+  };
+
+/* The part of a transfer that falls on one member. */
+struct member_part
+  {
+    struct block_request request;       /* Request to the member. */
+    struct block_iovec *iov;            /* Buffers, in member order. */
+    size_t iov_cnt;                     /* Number of elements in IOV. */
+  };
+
+static struct block_operations raid0_operations;
+
+/* Creates a RAID-0 array named "md0" from the block devices named
+   in MEMBERS, separated by commas, with stripe units of STRIPE_KB
+   kB, and registers it as a raw block device that the -filesys,
+   -scratch or -swap option can cast in a role.  Its size is that
+   of the smallest member, rounded down to a whole number of
+   stripe units, times the number of members.  Members must be raw
+   devices.  Modifies MEMBERS. */
+void
+raid0_init (char *members, unsigned stripe_kb)
+{
+  struct raid0 *r;
+  block_sector_t member_size = 0;
+  char *name, *save_ptr;
+  char extra_info[64];
+  size_t i;
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL)
+    PANIC ("md0: out of memory");
+  r->stripe = stripe_kb * 1024 / BLOCK_SECTOR_SIZE;
+  if (r->stripe == 0)
+    PANIC ("md0: stripe size must be at least 1 kB");
+
+  for (name = strtok_r (members, ",", &save_ptr); name != NULL;
+       name = strtok_r (NULL, ",", &save_ptr))
+    {
+      struct block *block = block_get_by_name (name);
+      block_sector_t size;
+
+      if (block == NULL)
+        PANIC ("md0: no such block device \"%s\"", name);
+      /* Partitions with a role may also be picked as the default
+         file system, scratch or swap device, which would then share
+         sectors with md0. */
+      if (block_type (block) != BLOCK_RAW)
+        PANIC ("md0: %s is a %s device, not raw", name,
+               block_type_name (block_type (block)));
+      if (r->member_cnt >= MAX_MEMBERS)
+        PANIC ("md0: more than %d members", MAX_MEMBERS);
+      for (i = 0; i < r->member_cnt; i++)
+        if (r->members[i] == block)
+          PANIC ("md0: %s given twice", name);
+
+      size = block_size (block) / r->stripe * r->stripe;
+      if (r->member_cnt == 0 || size < member_size)
+        member_size = size;
+      r->members[r->member_cnt++] = block;
+    }
+  if (r->member_cnt == 0)
+    PANIC ("md0: no member devices");
+  if (member_size == 0)
+    PANIC ("md0: members are smaller than one stripe unit");
+
+  snprintf (extra_info, sizeof extra_info, "RAID-0 of %zu devices, %u kB "
+            "stripe units", r->member_cnt, stripe_kb);
+  block_register ("md0", BLOCK_RAW, extra_info,
+                  member_size * r->member_cnt, &raid0_operations, r);
+}
+
+/* Signals the semaphore AUX that a member request completed. */
+static void
+part_done (struct block_request *request UNUSED, void *done)
+{
+  sema_up (done);
+}
+
+/* Transfers sectors of array R_, starting at SECTOR, to or from
+   the IOV_CNT buffers in IOV, depending on WRITE, by submitting
+   one request to each member that holds any of the sectors, and
+   waits for all of them to complete. */
+static void
+raid0_transfer (void *r_, block_sector_t sector,
+                const struct block_iovec *iov, size_t iov_cnt, bool write)
+{
+  struct raid0 *r = r_;
+  struct member_part parts[MAX_MEMBERS];
+  struct block_iovec *iovs;
+  struct semaphore done;
+  size_t sector_cnt = 0;
+  size_t max_iovs;
+  size_t iov_idx, iov_ofs;
+  size_t i;
+
+  for (i = 0; i < iov_cnt; i++)
+    sector_cnt += iov[i].sector_cnt;
+
+  /* Each stripe unit touched, and each boundary between buffers,
+     can start a new member iovec. */
+  max_iovs = sector_cnt / r->stripe + 2 + iov_cnt;
+  iovs = malloc (r->member_cnt * max_iovs * sizeof *iovs);
+  if (iovs == NULL)
+    PANIC ("md0: out of memory");
+  for (i = 0; i < r->member_cnt; i++)
+    {
+      parts[i].iov = iovs + i * max_iovs;
+      parts[i].iov_cnt = 0;
+    }
+
+  /* Walk the transfer one stripe unit at a time, appending the
+     buffers for each unit to its member's part. */
+  iov_idx = iov_ofs = 0;
+  while (sector_cnt > 0)
+    {
+      block_sector_t unit = sector / r->stripe;
+      block_sector_t unit_ofs = sector % r->stripe;
+      size_t unit_cnt = r->stripe - unit_ofs;
+      struct member_part *p = &parts[unit % r->member_cnt];
+
+      if (unit_cnt > sector_cnt)
+        unit_cnt = sector_cnt;
+      if (p->iov_cnt == 0)
+        p->request.sector = unit / r->member_cnt * r->stripe + unit_ofs;
+      sector += unit_cnt;
+      sector_cnt -= unit_cnt;
+
+      while (unit_cnt > 0)
+        {
+          size_t cnt = iov[iov_idx].sector_cnt - iov_ofs;
+          struct block_iovec *v;
+
+          if (cnt > unit_cnt)
+            cnt = unit_cnt;
+          ASSERT (p->iov_cnt < max_iovs);
+          v = &p->iov[p->iov_cnt++];
+          v->buffer = ((uint8_t *) iov[iov_idx].buffer
+                       + iov_ofs * BLOCK_SECTOR_SIZE);
+          v->sector_cnt = cnt;
+          unit_cnt -= cnt;
+          iov_ofs += cnt;
+          if (iov_ofs == iov[iov_idx].sector_cnt)
+            {
+              iov_idx++;
+              iov_ofs = 0;
+            }
+        }
+    }
+
+  /* Submit the parts and wait for them. */
+  sema_init (&done, 0);
+  for (i = 0; i < r->member_cnt; i++)
+    if (parts[i].iov_cnt > 0)
+      {
+        struct block_request *req = &parts[i].request;
+        req->iov = parts[i].iov;
+        req->iov_cnt = parts[i].iov_cnt;
+        req->write = write;
+        req->done = part_done;
+        req->aux = &done;
+        block_submit (r->members[i], req);
+      }
+  for (i = 0; i < r->member_cnt; i++)
+    if (parts[i].iov_cnt > 0)
+      sema_down (&done);
+
+  free (iovs);
+}
+
+/* Reads sectors starting at SECTOR of array R_ into the IOV_CNT
+   buffers in IOV. */
+static void
+raid0_readv (void *r_, block_sector_t sector,
+             const struct block_iovec *iov, size_t iov_cnt)
+{
+  raid0_transfer (r_, sector, iov, iov_cnt, false);
+}
+
+/* Writes the IOV_CNT buffers in IOV to sectors starting at SECTOR
+   of array R_. */
+static void
+raid0_writev (void *r_, block_sector_t sector,
+              const struct block_iovec *iov, size_t iov_cnt)
+{
+  raid0_transfer (r_, sector, iov, iov_cnt, true);
+}
+
+/* Reads sector SECTOR from array R_ into BUFFER. */
+static void
+raid0_read (void *r_, block_sector_t sector, void *buffer)
+{
+  struct block_iovec iov = { buffer, 1 };
+  raid0_readv (r_, sector, &iov, 1);
+}
+
+/* Writes BUFFER into sector SECTOR of array R_. */
+static void
+raid0_write (void *r_, block_sector_t sector, const void *buffer)
+{
+  struct block_iovec iov = { (void *) buffer, 1 };
+  raid0_writev (r_, sector, &iov, 1);
+}
+
+static struct block_operations raid0_operations =
+  {
+    raid0_read,
+    raid0_write,
+    raid0_readv,
+    raid0_writev,
+    NULL
+  };
@@ -0,0 +1,6 @@
+#ifndef DEVICES_RAID0_H
+#define DEVICES_RAID0_H
+
+void raid0_init (char *members, unsigned stripe_kb);
+
+#endif /* devices/raid0.h */
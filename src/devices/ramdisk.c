@@ -0,0 +1,132 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* A block device whose sectors are held in kernel memory.  Its
+   contents are lost at power off, so it suits scratch and swap,
+   and a file system formatted with -f, and is useful for
+   measuring the cost of the file system and virtual memory code
+   without the cost of emulated disk I/O.
+
+   The memory comes from the kernel pool one page at a time, so
+   the disk need not be contiguous in memory. */
+
+/* Number of sectors in a page. */
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* A RAM disk. */
+struct ramdisk
+  {
+    uint8_t **pages;            /* Pages that hold the sectors. */
+    size_t page_cnt;            /* Number of pages. */
+  };
+
+static struct block_operations ramdisk_operations;
+
+/* Creates a RAM disk of SIZE_KB kilobytes, rounded up to a whole
+   page, named "ram0", and registers it as a raw block device that
+   the -filesys, -scratch or -swap option can cast in a role.
+   Does nothing if SIZE_KB is 0. */
+void
+ramdisk_init (size_t size_kb)
+{
+  struct ramdisk *rd;
+  size_t i;
+
+  if (size_kb == 0)
+    return;
+
+  rd = malloc (sizeof *rd);
+  if (rd == NULL)
+    PANIC ("ram0: out of memory");
+  rd->page_cnt = DIV_ROUND_UP (size_kb * 1024, PGSIZE);
+  rd->pages = malloc (rd->page_cnt * sizeof *rd->pages);
+  if (rd->pages == NULL)
+    PANIC ("ram0: out of memory");
+  for (i = 0; i < rd->page_cnt; i++)
+    {
+      rd->pages[i] = palloc_get_page (PAL_ZERO);
+      if (rd->pages[i] == NULL)
+        PANIC ("ram0: out of memory after %zu of %zu pages",
+               i, rd->page_cnt);
+    }
+
+  block_register ("ram0", BLOCK_RAW, "RAM disk",
+                  rd->page_cnt * SECTORS_PER_PAGE, &ramdisk_operations, rd);
+}
+
+/* Returns the address in RD's memory of SECTOR. */
+static uint8_t *
+sector_address (struct ramdisk *rd, block_sector_t sector)
+{
+  ASSERT (sector / SECTORS_PER_PAGE < rd->page_cnt);
+  return (rd->pages[sector / SECTORS_PER_PAGE]
+          + sector % SECTORS_PER_PAGE * BLOCK_SECTOR_SIZE);
+}
+
+/* Copies sectors starting at SECTOR of RD into or, if WRITE is
+   true, out of the IOV_CNT buffers in IOV. */
+static void
+ramdisk_transfer (struct ramdisk *rd, block_sector_t sector,
+                  const struct block_iovec *iov, size_t iov_cnt, bool write)
+{
+  size_t i, j;
+
+  for (i = 0; i < iov_cnt; i++)
+    for (j = 0; j < iov[i].sector_cnt; j++)
+      {
+        uint8_t *data = sector_address (rd, sector++);
+        uint8_t *buffer = (uint8_t *) iov[i].buffer + j * BLOCK_SECTOR_SIZE;
+        if (write)
+          memcpy (data, buffer, BLOCK_SECTOR_SIZE);
+        else
+          memcpy (buffer, data, BLOCK_SECTOR_SIZE);
+      }
+}
+
+/* Reads sector SECTOR from RD_ into BUFFER. */
+static void
+ramdisk_read (void *rd_, block_sector_t sector, void *buffer)
+{
+  memcpy (buffer, sector_address (rd_, sector), BLOCK_SECTOR_SIZE);
+}
+
+/* Writes BUFFER into sector SECTOR of RD_. */
+static void
+ramdisk_write (void *rd_, block_sector_t sector, const void *buffer)
+{
+  memcpy (sector_address (rd_, sector), buffer, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads sectors starting at SECTOR of RD_ into the IOV_CNT
+   buffers in IOV. */
+static void
+ramdisk_readv (void *rd_, block_sector_t sector,
+               const struct block_iovec *iov, size_t iov_cnt)
+{
+  ramdisk_transfer (rd_, sector, iov, iov_cnt, false);
+}
+
+/* Writes the IOV_CNT buffers in IOV to sectors starting at SECTOR
+   of RD_. */
+static void
+ramdisk_writev (void *rd_, block_sector_t sector,
+                const struct block_iovec *iov, size_t iov_cnt)
+{
+  ramdisk_transfer (rd_, sector, iov, iov_cnt, true);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_readv,
+    ramdisk_writev,
+    NULL
+  };
@@ -1,27 +1,264 @@
 /**
+ * Enhanced Host Controller Interface driver
  *
- * Actual EHCI will be implemented later
- *
- * For now, we just deactivate the EHCI controller and routing circuitry
- * so that any USB2.0 devices activated by the BIOS will show up on the 
- * USB1.1 controllers instead of being routed to EHCI and therefore "invisible"
- * to the system.
+ * Drives high-speed (USB 2.0) devices on the root ports through the
+ * asynchronous schedule: one queue head per endpoint, linked into a
+ * circular list behind a dummy head, with chains of queue transfer
+ * descriptors (qTDs) that each cover up to 16 kB.
  *
+ * Full- and low-speed devices are handed to the companion UHCI
+ * controllers by setting the port owner bit, so they keep working as
+ * before.  Split transactions through high-speed hubs and the periodic
+ * schedule are not supported; interrupt endpoints are polled through
+ * the asynchronous schedule like bulk endpoints.
  */
 
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include <kernel/bitmap.h>
+#include "threads/pte.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/interrupt.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 #include "devices/pci.h"
 #include "devices/usb.h"
-#include <stdlib.h>
-#include <stdio.h>
+#include "devices/timer.h"
+
+#define EHCI_MAX_PORTS		15
+
+#define QH_ENTRIES		(4096/64)	/* queue heads per pool page */
+#define QTD_ENTRIES		(4096/64)	/* qTDs per pool page */
+#define QTD_MAX_BYTES		(16 * 1024)	/* bytes covered by one qTD */
+#define QTD_MAX_CHAIN		8	/* qTDs per transfer, at most */
 
 /* capability registers */
 #define EHCI_REG_CAPLENGTH	0x00
+#define EHCI_REG_HCSPARAMS	0x04
+#define EHCI_REG_HCCPARAMS	0x08
+
+#define HCS_N_PORTS(x)		((x) & 0xf)
+#define HCS_PPC			(1 << 4)	/* port power control */
+#define HCC_EECP(x)		(((x) >> 8) & 0xff)
 
 /* operational regisers - must be offset by op_base */
+#define EHCI_REG_USBCMD		0x00
+#define EHCI_REG_USBSTS		0x04
+#define EHCI_REG_USBINTR	0x08
+#define EHCI_REG_FRINDEX	0x0c
+#define EHCI_REG_CTRLDSSEGMENT	0x10
+#define EHCI_REG_ASYNCLISTADDR	0x18
 #define EHCI_REG_CONFIGFLAG	0x40
+#define EHCI_REG_PORTSC		0x44	/* first port; 4 bytes each */
+
+/* command register */
+#define EHCI_CMD_RS		(1 << 0)	/* run/stop */
+#define EHCI_CMD_HCRESET	(1 << 1)	/* host controller reset */
+#define EHCI_CMD_ASE		(1 << 5)	/* async schedule enable */
+#define EHCI_CMD_IAAD		(1 << 6)	/* interrupt on async advance */
+#define EHCI_CMD_ITC(x)		((x) << 16)	/* interrupt threshold */
+
+/* status and interrupt enable registers */
+#define EHCI_STS_USBINT		(1 << 0)	/* transfer completed */
+#define EHCI_STS_USBERRINT	(1 << 1)	/* transfer failed */
+#define EHCI_STS_PCD		(1 << 2)	/* port change detected */
+#define EHCI_STS_FLR		(1 << 3)	/* frame list rollover */
+#define EHCI_STS_HSE		(1 << 4)	/* host system error */
+#define EHCI_STS_IAA		(1 << 5)	/* async advance */
+#define EHCI_STS_HALTED		(1 << 12)
+#define EHCI_STS_ACK_MASK	0x3f
+
+/* port status and control register */
+#define EHCI_PORT_CCS		(1 << 0)	/* device is connected */
+#define EHCI_PORT_CSC		(1 << 1)	/* connect status changed */
+#define EHCI_PORT_PED		(1 << 2)	/* port enabled */
+#define EHCI_PORT_PEDC		(1 << 3)	/* enable changed */
+#define EHCI_PORT_OCC		(1 << 5)	/* over-current changed */
+#define EHCI_PORT_RESET		(1 << 8)
+#define EHCI_PORT_LS_MASK	(3 << 10)	/* line status */
+#define EHCI_PORT_LS_K		(1 << 10)	/* K-state: low-speed device */
+#define EHCI_PORT_POWER		(1 << 12)
+#define EHCI_PORT_OWNER		(1 << 13)	/* companion owns the port */
+#define EHCI_PORT_WC		(EHCI_PORT_CSC | EHCI_PORT_PEDC | EHCI_PORT_OCC)
+
+/* legacy support extended capability, in PCI config space */
+#define EHCI_LEGSUP_ID		1
+#define EHCI_LEGSUP_BIOS_OWNED	(1 << 16)
+#define EHCI_LEGSUP_OS_OWNED	(1 << 24)
+
+/* link pointers */
+#define LINK_TERMINATE		1
+#define LINK_TYPE_QH		(1 << 1)
+
+/* qTD token */
+#define QTD_STS_PING		(1 << 0)
+#define QTD_STS_XACT		(1 << 3)	/* transaction error */
+#define QTD_STS_BABBLE		(1 << 4)
+#define QTD_STS_BUFFER		(1 << 5)	/* data buffer error */
+#define QTD_STS_HALTED		(1 << 6)
+#define QTD_STS_ACTIVE		(1 << 7)
+#define QTD_PID_OUT		(0 << 8)
+#define QTD_PID_IN		(1 << 8)
+#define QTD_PID_SETUP		(2 << 8)
+#define QTD_CERR(x)		((x) << 10)	/* errors before halting */
+#define QTD_IOC			(1 << 15)	/* interrupt on complete */
+#define QTD_BYTES(x)		((x) << 16)
+#define QTD_BYTES_LEFT(x)	(((x) >> 16) & 0x7fff)
+#define QTD_TOGGLE		(1u << 31)
+
+/* queue head endpoint characteristics */
+#define QH_ADDR(x)		(x)
+#define QH_ADDR_MASK		0x7f
+#define QH_ENDPT(x)		((x) << 8)
+#define QH_EPS_HIGH		(2 << 12)	/* high-speed endpoint */
+#define QH_DTC			(1 << 14)	/* data toggle from qTD */
+#define QH_HEAD			(1 << 15)	/* head of reclamation list */
+#define QH_MAXPKT(x)		((x) << 16)
+#define QH_NAK_RELOAD(x)	((x) << 28)
+#define QH_MULT(x)		((x) << 30)
+
+/* hardware structures */
+#pragma pack(1)
+struct ehci_qtd
+{
+  uint32_t next;		/* next qTD pointer */
+  uint32_t alt_next;		/* next qTD on short packet */
+  uint32_t token;
+  uint32_t buffer[5];		/* page pointers, first with offset */
+
+  /* software use */
+  uint32_t len;			/* bytes requested */
+  uint32_t resv[7];		/* pad to 64 bytes */
+};
+
+struct ehci_qh
+{
+  uint32_t link;		/* horizontal link pointer */
+  uint32_t chars;		/* endpoint characteristics */
+  uint32_t caps;		/* endpoint capabilities */
+  uint32_t current;		/* current qTD pointer */
+  struct ehci_qtd_overlay
+  {
+    uint32_t next;
+    uint32_t alt_next;
+    uint32_t token;
+    uint32_t buffer[5];
+  } overlay;
+
+  /* software use */
+  uint32_t resv[4];		/* pad to 64 bytes */
+};
+#pragma pack()
+
+struct ehci_info
+{
+  struct pci_dev *dev;
+  struct pci_io *io;		/* memory-mapped registers */
+  int op_base;			/* offset of operational registers */
+  struct lock lock;		/* protects schedule and pools */
+
+  struct ehci_qh *head;		/* dummy head of the async schedule */
+  struct ehci_qtd *dead_qtd;	/* inactive qTD, stops a short transfer */
+
+  struct ehci_qh *qh_pool;
+  struct bitmap *qh_used;
+  struct ehci_qtd *qtd_pool;
+  struct bitmap *qtd_used;
+  struct semaphore qtd_sem;	/* counts free qTDs */
+  struct lock qtd_lock;		/* serializes taking several qTDs */
+
+  struct semaphore iaa_sem;	/* async advance doorbell answered */
+
+  uint8_t num_ports;
+  uint8_t attached_ports;	/* high-speed devices on root ports */
+
+  struct list waiting;		/* transfers waiting to complete */
+};
+
+struct ehci_dev_info
+{
+  struct ehci_info *ui;		/* owner */
+  int dev_addr;			/* device address */
+  struct list eops;		/* endpoints of this device */
+};
+
+struct ehci_eop_info
+{
+  struct ehci_dev_info *ud;
+  struct ehci_qh *qh;		/* queue head for this endpoint */
+  int eop;
+  int maxpkt;			/* max packet size */
+  int toggle;			/* data toggle for the next packet */
+  struct list_elem peers;	/* next eop on device */
+};
+
+/* A transfer waiting for the controller. */
+struct ehci_wait
+{
+  struct ehci_qtd *qtds[QTD_MAX_CHAIN];
+  int qtd_cnt;
+  struct semaphore sem;
+  struct list_elem peers;
+};
+
+#define ehci_lock(x)	lock_acquire(&(x)->lock)
+#define ehci_unlock(x)	lock_release(&(x)->lock)
 
 void ehci_init (void);
 
+static struct ehci_info *ehci_create_info (struct pci_dev *,
+					   struct pci_io *io);
+static bool ehci_take_ownership (struct ehci_info *ui);
+static bool ehci_reset (struct ehci_info *ui);
+static void ehci_start (struct ehci_info *ui);
+static int ehci_route_port (struct ehci_info *ui, int port);
+static void ehci_irq (void *ehci_data);
+static void ehci_process_completed (struct ehci_info *ui);
+static bool transfer_done (struct ehci_wait *w);
+
+static int ehci_detect_change (host_info);
+static int ehci_tx_pkt (host_eop_info eop, int token, void *pkt,
+			int min_sz, int max_sz, int *in_sz, bool wait);
+static int ehci_tx_chain (struct ehci_eop_info *ue, int token, void *buf,
+			  int sz, int *tx);
+static host_eop_info ehci_create_eop (host_dev_info hd, int eop, int maxpkt);
+static void ehci_remove_eop (host_eop_info hei);
+static host_dev_info ehci_create_chan (host_info hi, int dev_addr, int ver);
+static void ehci_modify_chan (host_dev_info, int dev_addr, int ver);
+static void ehci_destroy_chan (host_dev_info);
+static void ehci_set_toggle (host_eop_info, int toggle);
+
+static struct ehci_qh *qh_alloc (struct ehci_info *ui);
+static void qh_free (struct ehci_info *ui, struct ehci_qh *qh);
+static void qtd_acquire (struct ehci_info *ui, struct ehci_qtd **, int cnt);
+static void qtd_release (struct ehci_info *ui, struct ehci_qtd *);
+
+static struct usb_host ehci_host = {
+  .name = "EHCI",
+  .tx_pkt = ehci_tx_pkt,
+  .detect_change = ehci_detect_change,
+  .create_dev_channel = ehci_create_chan,
+  .remove_dev_channel = ehci_destroy_chan,
+  .modify_dev_channel = ehci_modify_chan,
+  .set_toggle = ehci_set_toggle,
+  .create_eop = ehci_create_eop,
+  .remove_eop = ehci_remove_eop
+};
+
+static inline uint32_t
+op_read (struct ehci_info *ui, int reg)
+{
+  return pci_reg_read32 (ui->io, ui->op_base + reg);
+}
+
+static inline void
+op_write (struct ehci_info *ui, int reg, uint32_t val)
+{
+  pci_reg_write32 (ui->io, ui->op_base + reg, val);
+}
 
 void
 ehci_init (void)
@@ -34,7 +271,8 @@ ehci_init (void)
 				     PCI_USB_IFACE_EHCI, dev_num)) != NULL)
     {
       struct pci_io *io;
-      uint8_t op_base;
+      struct ehci_info *ui;
+      int i;
 
       dev_num++;
       io = pci_io_enum (pd, NULL);
@@ -43,10 +281,615 @@ ehci_init (void)
 	  printf ("IO not found on EHCI device?\n");
 	  continue;
 	}
-      printf ("Disabling the EHCI controller #%d\n", dev_num - 1);
-      op_base = pci_reg_read8 (io, EHCI_REG_CAPLENGTH);
 
-      /* turn off EHCI routing */
-      pci_reg_write32 (io, EHCI_REG_CONFIGFLAG + op_base, 0);
+      pci_enable (pd);
+      ui = ehci_create_info (pd, io);
+      if (!ehci_take_ownership (ui) || !ehci_reset (ui))
+	{
+	  /* leave every port to the companion controllers */
+	  printf ("EHCI #%d: controller unusable, disabling\n", dev_num - 1);
+	  op_write (ui, EHCI_REG_CONFIGFLAG, 0);
+	  continue;
+	}
+
+      pci_register_irq (pd, ehci_irq, ui);
+      ehci_start (ui);
+
+      ui->attached_ports = 0;
+      for (i = 0; i < ui->num_ports; i++)
+	ui->attached_ports += ehci_route_port (ui, i);
+      printf ("EHCI #%d: %d root ports, %d high-speed devices\n",
+	      dev_num - 1, ui->num_ports, ui->attached_ports);
+
+      if (ui->attached_ports > 0)
+	usb_register_host (&ehci_host, ui);
     }
 }
+
+static struct ehci_info *
+ehci_create_info (struct pci_dev *pd, struct pci_io *io)
+{
+  struct ehci_info *ui;
+
+  ui = malloc (sizeof (struct ehci_info));
+  if (ui == NULL)
+    PANIC ("EHCI: out of memory");
+  ui->dev = pd;
+  ui->io = io;
+  ui->op_base = pci_reg_read8 (io, EHCI_REG_CAPLENGTH);
+  ui->num_ports = HCS_N_PORTS (pci_reg_read32 (io, EHCI_REG_HCSPARAMS));
+  if (ui->num_ports > EHCI_MAX_PORTS)
+    ui->num_ports = EHCI_MAX_PORTS;
+  lock_init (&ui->lock);
+
+  ui->qh_pool = palloc_get_page (PAL_ASSERT | PAL_NOCACHE | PAL_ZERO);
+  ui->qh_used = bitmap_create (QH_ENTRIES);
+  ui->qtd_pool = palloc_get_page (PAL_ASSERT | PAL_NOCACHE | PAL_ZERO);
+  ui->qtd_used = bitmap_create (QTD_ENTRIES);
+  if (ui->qh_used == NULL || ui->qtd_used == NULL)
+    PANIC ("EHCI: out of memory");
+  lock_init (&ui->qtd_lock);
+  sema_init (&ui->iaa_sem, 0);
+  list_init (&ui->waiting);
+
+  /* dummy head of the async schedule: it has no qTDs and is marked
+     halted, so the controller only uses it to detect an empty pass */
+  ehci_lock (ui);
+  ui->head = qh_alloc (ui);
+  ehci_unlock (ui);
+  ui->head->link = vtop (ui->head) | LINK_TYPE_QH;
+  ui->head->chars = QH_HEAD | QH_EPS_HIGH;
+  ui->head->caps = QH_MULT (1);
+  ui->head->overlay.next = LINK_TERMINATE;
+  ui->head->overlay.alt_next = LINK_TERMINATE;
+  ui->head->overlay.token = QTD_STS_HALTED;
+
+  /* every qTD's alternate next pointer leads here, so that a short
+     packet ends the transfer instead of starting the next qTD */
+  ui->dead_qtd = &ui->qtd_pool[QTD_ENTRIES - 1];
+  bitmap_mark (ui->qtd_used, QTD_ENTRIES - 1);
+  sema_init (&ui->qtd_sem, QTD_ENTRIES - 1);
+  ui->dead_qtd->next = LINK_TERMINATE;
+  ui->dead_qtd->alt_next = LINK_TERMINATE;
+  ui->dead_qtd->token = 0;
+
+  return ui;
+}
+
+/* Asks the BIOS to hand over the controller, if it uses it for legacy
+   keyboard or storage emulation.  Returns false if it won't. */
+static bool
+ehci_take_ownership (struct ehci_info *ui)
+{
+  int eecp = HCC_EECP (pci_reg_read32 (ui->io, EHCI_REG_HCCPARAMS));
+  int i;
+
+  if (eecp < 0x40
+      || (pci_read_config32 (ui->dev, eecp) & 0xff) != EHCI_LEGSUP_ID)
+    return true;
+
+  pci_write_config8 (ui->dev, eecp + 3, 1);
+  for (i = 0; i < 100; i++)
+    {
+      if (!(pci_read_config32 (ui->dev, eecp) & EHCI_LEGSUP_BIOS_OWNED))
+	return true;
+      timer_msleep (10);
+    }
+  return false;
+}
+
+/* Stops and resets the controller.  Returns false if it does not
+   respond. */
+static bool
+ehci_reset (struct ehci_info *ui)
+{
+  int i;
+
+  op_write (ui, EHCI_REG_USBINTR, 0);
+  op_write (ui, EHCI_REG_USBCMD, op_read (ui, EHCI_REG_USBCMD) & ~EHCI_CMD_RS);
+  for (i = 0; !(op_read (ui, EHCI_REG_USBSTS) & EHCI_STS_HALTED); i++)
+    {
+      if (i >= 20)
+	return false;
+      timer_msleep (1);
+    }
+
+  op_write (ui, EHCI_REG_USBCMD, EHCI_CMD_HCRESET);
+  for (i = 0; op_read (ui, EHCI_REG_USBCMD) & EHCI_CMD_HCRESET; i++)
+    {
+      if (i >= 250)
+	return false;
+      timer_msleep (1);
+    }
+  return true;
+}
+
+/* Starts the async schedule and takes every port from the companion
+   controllers. */
+static void
+ehci_start (struct ehci_info *ui)
+{
+  op_write (ui, EHCI_REG_CTRLDSSEGMENT, 0);
+  op_write (ui, EHCI_REG_ASYNCLISTADDR, vtop (ui->head));
+  op_write (ui, EHCI_REG_USBSTS, EHCI_STS_ACK_MASK);
+  op_write (ui, EHCI_REG_USBINTR,
+	    EHCI_STS_USBINT | EHCI_STS_USBERRINT | EHCI_STS_HSE
+	    | EHCI_STS_IAA);
+  op_write (ui, EHCI_REG_USBCMD,
+	    EHCI_CMD_ITC (1) | EHCI_CMD_ASE | EHCI_CMD_RS);
+  op_write (ui, EHCI_REG_CONFIGFLAG, 1);
+  timer_msleep (5);
+}
+
+/* Powers and resets root port PORT.  A high-speed device stays with
+   EHCI; a full- or low-speed device, or none at all, is handed to the
+   companion controller, so that the companion sees any device plugged
+   in later.  (A high-speed device plugged in later therefore runs at
+   full speed.)  Returns 1 if a high-speed device is now enabled on
+   the port, 0 otherwise. */
+static int
+ehci_route_port (struct ehci_info *ui, int port)
+{
+  int reg = EHCI_REG_PORTSC + port * 4;
+  uint32_t status;
+  int i;
+
+  status = op_read (ui, reg) & ~EHCI_PORT_WC;
+  if (pci_reg_read32 (ui->io, EHCI_REG_HCSPARAMS) & HCS_PPC
+      && !(status & EHCI_PORT_POWER))
+    {
+      op_write (ui, reg, status | EHCI_PORT_POWER);
+      timer_msleep (20);
+      status = op_read (ui, reg) & ~EHCI_PORT_WC;
+    }
+
+  if (!(status & EHCI_PORT_CCS)
+      || (status & EHCI_PORT_LS_MASK) == EHCI_PORT_LS_K)
+    {
+      op_write (ui, reg, status | EHCI_PORT_OWNER);
+      return 0;
+    }
+
+  /* reset; the controller enables the port only for high speed */
+  op_write (ui, reg, (status & ~EHCI_PORT_PED) | EHCI_PORT_RESET);
+  timer_msleep (50);
+  op_write (ui, reg, op_read (ui, reg) & ~(EHCI_PORT_WC | EHCI_PORT_RESET));
+  for (i = 0; op_read (ui, reg) & EHCI_PORT_RESET; i++)
+    {
+      if (i >= 10)
+	break;
+      timer_msleep (1);
+    }
+
+  status = op_read (ui, reg);
+  op_write (ui, reg, status);	/* clear change bits */
+  if (!(status & EHCI_PORT_PED))
+    {
+      op_write (ui, reg, (status & ~EHCI_PORT_WC) | EHCI_PORT_OWNER);
+      return 0;
+    }
+  return 1;
+}
+
+static void
+ehci_irq (void *ehci_data)
+{
+  struct ehci_info *ui = ehci_data;
+  uint32_t status;
+
+  status = op_read (ui, EHCI_REG_USBSTS) & EHCI_STS_ACK_MASK;
+  if (status == 0)
+    return;
+  op_write (ui, EHCI_REG_USBSTS, status);
+
+  if (status & EHCI_STS_HSE)
+    PANIC ("EHCI: Host system error");
+  if (status & (EHCI_STS_USBINT | EHCI_STS_USBERRINT))
+    ehci_process_completed (ui);
+  if (status & EHCI_STS_IAA)
+    sema_up (&ui->iaa_sem);
+}
+
+/* Wakes up every waiting transfer that has finished.  Runs in the
+   interrupt handler. */
+static void
+ehci_process_completed (struct ehci_info *ui)
+{
+  struct list_elem *li;
+
+  li = list_begin (&ui->waiting);
+  while (li != list_end (&ui->waiting))
+    {
+      struct ehci_wait *w = list_entry (li, struct ehci_wait, peers);
+      struct list_elem *next = list_next (li);
+
+      if (transfer_done (w))
+	{
+	  list_remove (li);
+	  sema_up (&w->sem);
+	}
+      li = next;
+    }
+}
+
+/* Returns true if the controller is done with transfer W: its last
+   qTD has been retired, or an earlier one halted or ended with a
+   short packet, so that the controller moved to the dead qTD. */
+static bool
+transfer_done (struct ehci_wait *w)
+{
+  int i;
+
+  for (i = 0; i < w->qtd_cnt; i++)
+    {
+      uint32_t token = w->qtds[i]->token;
+      if (token & QTD_STS_ACTIVE)
+	return false;
+      if (token & QTD_STS_HALTED || QTD_BYTES_LEFT (token) != 0)
+	return true;
+    }
+  return true;
+}
+
+static int
+ehci_detect_change (host_info hi)
+{
+  struct ehci_info *ui = hi;
+  int change = 0;
+  int i;
+
+  ehci_lock (ui);
+  for (i = 0; i < ui->num_ports && change == 0; i++)
+    {
+      int reg = EHCI_REG_PORTSC + i * 4;
+      uint32_t status = op_read (ui, reg);
+      if (status & EHCI_PORT_CSC && !(status & EHCI_PORT_OWNER))
+	{
+	  op_write (ui, reg, (status & ~EHCI_PORT_WC) | EHCI_PORT_CSC);
+	  change = 1;
+	}
+    }
+  ehci_unlock (ui);
+
+  return change;
+}
+
+/* Moves between MIN_SZ and MAX_SZ bytes at PKT to or from endpoint
+   HEI, storing the number moved into *IN_SZ.  Unlike UHCI, EHCI
+   ignores WAIT and always waits for the transfer to finish before
+   returning, even when WAIT is false. */
+static int
+ehci_tx_pkt (host_eop_info hei, int token, void *pkt, int min_sz,
+	     int max_sz, int *in_sz, bool wait UNUSED)
+{
+  struct ehci_eop_info *ue = hei;
+  int txed = 0;
+  int err;
+
+  ASSERT (min_sz <= max_sz);
+
+  if (ue->ud->ui->attached_ports == 0)
+    return USB_HOST_ERR_NODEV;
+
+  /* setup token acts to synchronize data toggle */
+  if (token == USB_TOKEN_SETUP)
+    ue->toggle = 0;
+
+  /* Transfers that are not bulk move a single packet.  Every
+     transfer completes before returning; queueing without waiting
+     buys nothing here, since a whole bulk transfer is one qTD
+     chain. */
+  if (min_sz == 0 && max_sz > ue->maxpkt)
+    max_sz = ue->maxpkt;
+
+  /* bulk transfers longer than one chain take several */
+  do
+    {
+      int chain_sz = max_sz - txed;
+      int chain_txed;
+
+      if (chain_sz > QTD_MAX_CHAIN * QTD_MAX_BYTES)
+	chain_sz = QTD_MAX_CHAIN * QTD_MAX_BYTES;
+      err = ehci_tx_chain (ue, token, pkt == NULL ? NULL : pkt + txed,
+			   chain_sz, &chain_txed);
+      txed += chain_txed;
+      if (chain_txed < chain_sz)
+	break;
+    }
+  while (err == USB_HOST_ERR_NONE && txed < max_sz);
+
+  if (in_sz != NULL)
+    *in_sz = txed;
+  return err;
+}
+
+/* Sets the buffer pointers of QTD to cover SZ bytes at BUF, which
+   must be kernel memory and thus physically contiguous. */
+static void
+qtd_set_buffer (struct ehci_qtd *qtd, void *buf, int sz)
+{
+  uint32_t phys;
+  int i;
+
+  memset (qtd->buffer, 0, sizeof qtd->buffer);
+  if (sz == 0)
+    return;
+  phys = vtop (buf);
+  qtd->buffer[0] = phys;
+  for (i = 1; i < 5; i++)
+    {
+      phys = ROUND_DOWN (phys, PGSIZE) + PGSIZE;
+      qtd->buffer[i] = phys;
+    }
+}
+
+/* Moves up to SZ bytes at BUF to or from endpoint UE as one chain of
+   qTDs, queued on the endpoint's queue head, and waits for the chain
+   to finish.  Stores the number of bytes moved into *TX. */
+static int
+ehci_tx_chain (struct ehci_eop_info *ue, int token, void *buf, int sz,
+	       int *tx)
+{
+  struct ehci_info *ui = ue->ud->ui;
+  struct ehci_qh *qh = ue->qh;
+  struct ehci_wait w;
+  enum intr_level old_level;
+  uint32_t pid, toggle, last_token = 0;
+  int i, ofs, err;
+
+  pid = (token == USB_TOKEN_SETUP ? QTD_PID_SETUP
+	 : token == USB_TOKEN_IN ? QTD_PID_IN : QTD_PID_OUT);
+
+  w.qtd_cnt = sz == 0 ? 1 : DIV_ROUND_UP (sz, QTD_MAX_BYTES);
+  ASSERT (w.qtd_cnt <= QTD_MAX_CHAIN);
+  qtd_acquire (ui, w.qtds, w.qtd_cnt);
+  sema_init (&w.sem, 0);
+
+  /* Every qTD but the last is a whole number of packets, so the
+     toggle of each follows from the packets before it. */
+  toggle = ue->toggle;
+  for (i = 0, ofs = 0; i < w.qtd_cnt; i++)
+    {
+      struct ehci_qtd *qtd = w.qtds[i];
+      int len = sz - ofs < QTD_MAX_BYTES ? sz - ofs : QTD_MAX_BYTES;
+
+      qtd->next = (i + 1 < w.qtd_cnt
+		   ? vtop (w.qtds[i + 1]) : (uint32_t) LINK_TERMINATE);
+      qtd->alt_next = vtop (ui->dead_qtd);
+      qtd->len = len;
+      qtd_set_buffer (qtd, buf == NULL ? NULL : buf + ofs, len);
+      qtd->token = (QTD_STS_ACTIVE | pid | QTD_CERR (3) | QTD_IOC
+		    | QTD_BYTES (len) | (toggle ? QTD_TOGGLE : 0));
+      toggle ^= DIV_ROUND_UP (len, ue->maxpkt) & 1;
+      ofs += len;
+    }
+
+  /* Point the idle queue head's overlay at the chain, which also
+     clears a halt left by an earlier stall. */
+  ehci_lock (ui);
+  old_level = intr_disable ();
+  list_push_back (&ui->waiting, &w.peers);
+  qh->current = 0;
+  qh->overlay.alt_next = LINK_TERMINATE;
+  qh->overlay.token = 0;
+  barrier ();
+  qh->overlay.next = vtop (w.qtds[0]);
+  intr_set_level (old_level);
+  ehci_unlock (ui);
+
+  sema_down (&w.sem);
+
+  /* count bytes and find the qTD that ended the transfer */
+  *tx = 0;
+  err = USB_HOST_ERR_NONE;
+  for (i = 0; i < w.qtd_cnt; i++)
+    {
+      uint32_t tok = w.qtds[i]->token;
+      if (tok & QTD_STS_ACTIVE)
+	break;
+      *tx += w.qtds[i]->len - QTD_BYTES_LEFT (tok);
+      last_token = tok;
+      if (tok & QTD_STS_HALTED)
+	{
+	  if (tok & QTD_STS_BABBLE)
+	    err = USB_HOST_ERR_BABBLE;
+	  else if (tok & QTD_STS_BUFFER)
+	    err = USB_HOST_ERR_BUFFER;
+	  else if (tok & QTD_STS_XACT)
+	    err = USB_HOST_ERR_TIMEOUT;
+	  else
+	    err = USB_HOST_ERR_STALL;
+	  break;
+	}
+      if (QTD_BYTES_LEFT (tok) != 0)
+	break;
+    }
+
+  /* the controller writes back the toggle for the next packet */
+  if (err == USB_HOST_ERR_NONE)
+    ue->toggle = (last_token & QTD_TOGGLE) != 0;
+
+  /* stop the queue head from following a chain cut short */
+  ehci_lock (ui);
+  qh->overlay.next = LINK_TERMINATE;
+  ehci_unlock (ui);
+  for (i = 0; i < w.qtd_cnt; i++)
+    qtd_release (ui, w.qtds[i]);
+
+  return err;
+}
+
+static host_dev_info
+ehci_create_chan (host_info hi, int dev_addr, int ver UNUSED)
+{
+  struct ehci_dev_info *ud;
+
+  ASSERT (dev_addr <= 127 && dev_addr >= 0);
+
+  ud = malloc (sizeof (struct ehci_dev_info));
+  if (ud == NULL)
+    PANIC ("EHCI: out of memory");
+  ud->ui = hi;
+  ud->dev_addr = dev_addr;
+  list_init (&ud->eops);
+  return ud;
+}
+
+static void
+ehci_modify_chan (host_dev_info hd, int dev_addr, int ver UNUSED)
+{
+  struct ehci_dev_info *ud = hd;
+  struct list_elem *li;
+
+  ehci_lock (ud->ui);
+  ud->dev_addr = dev_addr;
+  for (li = list_begin (&ud->eops); li != list_end (&ud->eops);
+       li = list_next (li))
+    {
+      struct ehci_eop_info *ue = list_entry (li, struct ehci_eop_info, peers);
+      ue->qh->chars = (ue->qh->chars & ~QH_ADDR_MASK) | QH_ADDR (dev_addr);
+    }
+  ehci_unlock (ud->ui);
+}
+
+static void
+ehci_destroy_chan (host_dev_info hd)
+{
+  struct ehci_dev_info *ud = hd;
+
+  while (!list_empty (&ud->eops))
+    ehci_remove_eop (list_entry (list_front (&ud->eops),
+				 struct ehci_eop_info, peers));
+  free (ud);
+}
+
+static host_eop_info
+ehci_create_eop (host_dev_info hd, int eop, int maxpkt)
+{
+  struct ehci_dev_info *ud = hd;
+  struct ehci_info *ui = ud->ui;
+  struct ehci_eop_info *ue;
+  struct ehci_qh *qh;
+
+  ue = malloc (sizeof (struct ehci_eop_info));
+  if (ue == NULL)
+    PANIC ("EHCI: out of memory");
+  ue->ud = ud;
+  ue->eop = eop;
+  ue->maxpkt = maxpkt;
+  ue->toggle = 0;
+
+  ehci_lock (ui);
+  qh = ue->qh = qh_alloc (ui);
+  qh->chars = (QH_ADDR (ud->dev_addr) | QH_ENDPT (eop) | QH_EPS_HIGH
+	       | QH_DTC | QH_MAXPKT (maxpkt) | QH_NAK_RELOAD (0));
+  qh->caps = QH_MULT (1);
+  qh->current = 0;
+  qh->overlay.next = LINK_TERMINATE;
+  qh->overlay.alt_next = LINK_TERMINATE;
+  qh->overlay.token = 0;
+
+  /* link in right behind the head */
+  qh->link = ui->head->link;
+  barrier ();
+  ui->head->link = vtop (qh) | LINK_TYPE_QH;
+  list_push_back (&ud->eops, &ue->peers);
+  ehci_unlock (ui);
+
+  return ue;
+}
+
+static void
+ehci_remove_eop (host_eop_info hei)
+{
+  struct ehci_eop_info *ue = hei;
+  struct ehci_info *ui = ue->ud->ui;
+  struct ehci_qh *prev;
+  uint32_t qh_link = vtop (ue->qh) | LINK_TYPE_QH;
+
+  ehci_lock (ui);
+
+  /* unlink from the circular async schedule */
+  prev = ui->head;
+  while (prev->link != qh_link)
+    {
+      prev = ptov (prev->link & ~0x1f);
+      ASSERT (prev != ui->head);
+    }
+  prev->link = ue->qh->link;
+  list_remove (&ue->peers);
+
+  /* the controller may still hold the queue head until it has
+     advanced past it; ring the doorbell and wait for the answer */
+  op_write (ui, EHCI_REG_USBCMD,
+	    op_read (ui, EHCI_REG_USBCMD) | EHCI_CMD_IAAD);
+  sema_down (&ui->iaa_sem);
+
+  qh_free (ui, ue->qh);
+  ehci_unlock (ui);
+
+  free (ue);
+}
+
+static void
+ehci_set_toggle (host_eop_info hei, int toggle)
+{
+  struct ehci_eop_info *ue = hei;
+  ue->toggle = toggle;
+}
+
+static struct ehci_qh *
+qh_alloc (struct ehci_info *ui)
+{
+  size_t qh_idx;
+  struct ehci_qh *qh;
+
+  ASSERT (lock_held_by_current_thread (&ui->lock));
+
+  qh_idx = bitmap_scan_and_flip (ui->qh_used, 0, 1, false);
+  if (qh_idx == BITMAP_ERROR)
+    PANIC ("EHCI: Too many queue heads in use-- runaway USB stack?\n");
+  qh = &ui->qh_pool[qh_idx];
+  memset (qh, 0, sizeof *qh);
+
+  return qh;
+}
+
+static void
+qh_free (struct ehci_info *ui, struct ehci_qh *qh)
+{
+  ASSERT (lock_held_by_current_thread (&ui->lock));
+  bitmap_reset (ui->qh_used, qh - ui->qh_pool);
+}
+
+/* Takes CNT qTDs from the pool into QTDS, waiting for other transfers
+   to give some back if necessary.  Taking them all under one lock
+   keeps two transfers from each holding part of what they need. */
+static void
+qtd_acquire (struct ehci_info *ui, struct ehci_qtd **qtds, int cnt)
+{
+  int i;
+
+  lock_acquire (&ui->qtd_lock);
+  for (i = 0; i < cnt; i++)
+    sema_down (&ui->qtd_sem);
+  ehci_lock (ui);
+  for (i = 0; i < cnt; i++)
+    {
+      size_t idx = bitmap_scan_and_flip (ui->qtd_used, 0, 1, false);
+      ASSERT (idx != BITMAP_ERROR);
+      qtds[i] = &ui->qtd_pool[idx];
+      memset (qtds[i], 0, sizeof *qtds[i]);
+    }
+  ehci_unlock (ui);
+  lock_release (&ui->qtd_lock);
+}
+
+static void
+qtd_release (struct ehci_info *ui, struct ehci_qtd *qtd)
+{
+  ehci_lock (ui);
+  bitmap_reset (ui->qtd_used, qtd - ui->qtd_pool);
+  ehci_unlock (ui);
+  sema_up (&ui->qtd_sem);
+}
@@ -32,6 +32,14 @@
 #define USB_PROTO_NO_COMPLETE	0x01
 #define USB_PROTO_BULK		0x50
 
+/* Bounce buffer size, in pages and in 512-byte blocks.  Every
+   READ(10) or WRITE(10) command moves up to MSC_MAX_BLOCKS blocks
+   through the bounce buffer.  Host controllers take bulk
+   transfers that do not cross a page boundary, so the data phase
+   of a command is split into one bulk transfer per page. */
+#define MSC_BOUNCE_PAGES	16
+#define MSC_MAX_BLOCKS		(MSC_BOUNCE_PAGES * PGSIZE / 512)
+
 #pragma pack(1)
 
 #define CBW_SIG_MAGIC	0x43425355
@@ -158,7 +166,7 @@ struct msc_class_info
   struct list_elem peers;
 };
 static void msc_get_geometry (struct msc_class_info *);
-static void msc_io (struct msc_class_info *, block_sector_t, void *buf, bool wr);
+static void msc_io (struct msc_class_info *, block_sector_t, int cnt, bool wr);
 static void msc_reset_recovery(struct msc_class_info* mci);
 static void msc_bulk_reset(struct msc_class_info* mci);
 
@@ -235,9 +243,7 @@ msc_attached (struct usb_iface *ui)
       return NULL;
     }
 
-  mci->bounce_buffer = palloc_get_multiple (PAL_ASSERT,
-					    DIV_ROUND_UP (mci->blk_size,
-							  PGSIZE));
+  mci->bounce_buffer = palloc_get_multiple (PAL_ASSERT, MSC_BOUNCE_PAGES);
   mbi = malloc (sizeof (struct msc_blk_info));
   mbi->mci = mci;
   snprintf (name, sizeof name, "ud%c", 'a' + dev_no++);
@@ -260,7 +266,8 @@ msc_read (void *mbi_, block_sector_t sector, void *buffer)
   struct msc_blk_info *mbi = mbi_;
 
   mci_lock (mbi->mci);
-  msc_io (mbi->mci, sector, buffer, false);
+  msc_io (mbi->mci, sector, 1, false);
+  memcpy (buffer, mbi->mci->bounce_buffer, mbi->mci->blk_size);
   mci_unlock (mbi->mci);
 }
 
@@ -270,14 +277,99 @@ msc_write (void *mbi_, block_sector_t sector, const void *buffer)
   struct msc_blk_info *mbi = mbi_;
 
   mci_lock (mbi->mci);
-  msc_io (mbi->mci, sector, (void *) buffer, true);
+  memcpy (mbi->mci->bounce_buffer, buffer, mbi->mci->blk_size);
+  msc_io (mbi->mci, sector, 1, true);
   mci_unlock (mbi->mci);
 }
 
+/* Transfers consecutive sectors starting at SECTOR to or from the
+   IOV_CNT buffers in IOV, up to MSC_MAX_BLOCKS sectors per
+   command, copying through the bounce buffer. */
+static void
+msc_transfer (struct msc_blk_info *mbi, block_sector_t sector,
+	      const struct block_iovec *iov, size_t iov_cnt, bool wr)
+{
+  struct msc_class_info *mci = mbi->mci;
+  size_t iov_idx = 0, iov_ofs = 0;
+
+  mci_lock (mci);
+  while (iov_idx < iov_cnt)
+    {
+      size_t first_idx = iov_idx, first_ofs = iov_ofs;
+      int cnt = 0;
+
+      /* Gather up to MSC_MAX_BLOCKS sectors, copying them into the
+         bounce buffer if writing. */
+      while (iov_idx < iov_cnt && cnt < MSC_MAX_BLOCKS)
+	{
+	  size_t n = iov[iov_idx].sector_cnt - iov_ofs;
+	  if (n > (size_t) (MSC_MAX_BLOCKS - cnt))
+	    n = MSC_MAX_BLOCKS - cnt;
+	  if (wr)
+	    memcpy ((uint8_t *) mci->bounce_buffer + cnt * BLOCK_SECTOR_SIZE,
+		    (uint8_t *) iov[iov_idx].buffer
+		    + iov_ofs * BLOCK_SECTOR_SIZE, n * BLOCK_SECTOR_SIZE);
+	  cnt += n;
+	  iov_ofs += n;
+	  if (iov_ofs == iov[iov_idx].sector_cnt)
+	    {
+	      iov_idx++;
+	      iov_ofs = 0;
+	    }
+	}
+
+      msc_io (mci, sector, cnt, wr);
+      sector += cnt;
+
+      /* Scatter what was read back into the same buffers. */
+      if (!wr)
+	{
+	  int done = 0;
+	  iov_idx = first_idx;
+	  iov_ofs = first_ofs;
+	  while (done < cnt)
+	    {
+	      size_t n = iov[iov_idx].sector_cnt - iov_ofs;
+	      if (n > (size_t) (cnt - done))
+		n = cnt - done;
+	      memcpy ((uint8_t *) iov[iov_idx].buffer
+		      + iov_ofs * BLOCK_SECTOR_SIZE,
+		      (uint8_t *) mci->bounce_buffer
+		      + done * BLOCK_SECTOR_SIZE, n * BLOCK_SECTOR_SIZE);
+	      done += n;
+	      iov_ofs += n;
+	      if (iov_ofs == iov[iov_idx].sector_cnt)
+		{
+		  iov_idx++;
+		  iov_ofs = 0;
+		}
+	    }
+	}
+    }
+  mci_unlock (mci);
+}
+
+static void
+msc_readv (void *mbi_, block_sector_t sector,
+	   const struct block_iovec *iov, size_t iov_cnt)
+{
+  msc_transfer (mbi_, sector, iov, iov_cnt, false);
+}
+
+static void
+msc_writev (void *mbi_, block_sector_t sector,
+	    const struct block_iovec *iov, size_t iov_cnt)
+{
+  msc_transfer (mbi_, sector, iov, iov_cnt, true);
+}
+
 static struct block_operations msc_operations = 
   {
     msc_read,
     msc_write,
+    msc_readv,
+    msc_writev,
+    NULL
   };
 
 static void
@@ -327,30 +419,35 @@ msc_get_geometry (struct msc_class_info *mci)
 
 }
 
+/* Reads CNT blocks starting at BN into the bounce buffer or, if
+   WR is true, writes them from it, with a single READ(10) or
+   WRITE(10) command.  The bulk-only transport does not allow the
+   next command block to be sent before this command's status has
+   been read, so commands cannot overlap; large commands are what
+   keeps the bus busy. */
 static void
-msc_io (struct msc_class_info *mci, block_sector_t bn, void *buf, bool wr)
+msc_io (struct msc_class_info *mci, block_sector_t bn, int cnt, bool wr)
 {
   struct msc_cbw cbw;
   struct msc_csw csw;
   struct scsi_cdb10 *cdb;
-  int tx;
+  int tx, ofs;
   int err;
 
-  if (wr)
-    memcpy (mci->bounce_buffer, buf, mci->blk_size);
+  ASSERT (cnt > 0 && cnt <= MSC_MAX_BLOCKS);
 
   memset (&cbw, 0, sizeof (cbw));
   cbw.sig = CBW_SIG_MAGIC;
   cbw.tag = mci->tag++;
-  cbw.tx_len = mci->blk_size;
+  cbw.tx_len = cnt * mci->blk_size;
   cbw.flags = (wr) ? CBW_FL_OUT : CBW_FL_IN;
   cbw.lun = 0;
   cbw.cb_len = sizeof (struct scsi_cdb10);
 
   cdb = (void *) (&cbw.cb);
   cdb->op = (wr) ? SCSI_OP_WRITE10 : SCSI_OP_READ10;
-  *((uint32_t *) ((uint8_t *) (&cdb->lba) + 1)) = machine_to_be24 (bn);
-  cdb->len = machine_to_be16 (1);
+  cdb->lba = machine_to_be32 (bn);
+  cdb->len = machine_to_be16 (cnt);
 
 //  msc_reset_endpoint (mci->eop_in);
 //  msc_reset_endpoint (mci->eop_out);
@@ -363,11 +460,17 @@ msc_io (struct msc_class_info *mci, block_sector_t bn, void *buf, bool wr)
       err = usb_dev_bulk (mci->eop_out, &cbw, sizeof (cbw), &tx);
     }
 
-  /* do storage io */
-  err = usb_dev_bulk ((wr) ? mci->eop_out : mci->eop_in,
-		      mci->bounce_buffer, mci->blk_size, &tx);
+  /* do storage io, a page at a time */
+  for (ofs = 0; ofs < cnt * mci->blk_size; ofs += PGSIZE)
+    {
+      int sz = cnt * mci->blk_size - ofs;
+      if (sz > PGSIZE)
+	sz = PGSIZE;
+      err = usb_dev_bulk ((wr) ? mci->eop_out : mci->eop_in,
+			  (uint8_t *) mci->bounce_buffer + ofs, sz, &tx);
+      ASSERT (tx == sz);
+    }
   memset (&csw, 0, sizeof (csw));
-  ASSERT (tx == mci->blk_size);
 
 
   /* get command status */
@@ -389,7 +492,7 @@ msc_io (struct msc_class_info *mci, block_sector_t bn, void *buf, bool wr)
       msc_reset_recovery(mci);
       printf ("reset complete\n");
       mci->retrying = true;
-      msc_io (mci, bn, buf, wr);
+      msc_io (mci, bn, cnt, wr);
       return;
     }
   mci->retrying = false;
@@ -398,8 +501,6 @@ msc_io (struct msc_class_info *mci, block_sector_t bn, void *buf, bool wr)
     {
       PANIC ("USB storage IO failure! - error %d\n", csw.status);
     }
-  if (!wr)
-    memcpy (buf, mci->bounce_buffer, mci->blk_size);
 }
 
 static void
@@ -24,6 +24,7 @@
 #define FRAME_LIST_ENTRIES	1024
 #define TD_ENTRIES		(4096/32)	/* number of entries allocated */
 #define QH_ENTRIES		(4096/16)
+#define TD_MAX_CHAIN		64	/* TDs queued for one bulk transfer */
 
 /* uhci pci registers */
 #define UHCI_REG_USBCMD		0x00	/* Command */
@@ -165,9 +166,12 @@ struct uhci_info
   struct list waiting;		/* threads waiting */
 };
 
+/* a single TD, or a chain of TD_CNT TDs in TDS, waiting to complete */
 struct usb_wait
 {
   struct tx_descriptor *td;
+  struct tx_descriptor **tds;
+  int td_cnt;
   struct uhci_dev_info *ud;
   struct semaphore sem;
   struct list_elem peers;
@@ -212,6 +216,9 @@ static int uhci_tx_pkt_wait (struct uhci_eop_info *ue, int token, void *pkt,
 			     int max_sz, int *in_sz);
 static int uhci_tx_pkt_bulk (struct uhci_eop_info *ue, int token, void *buf,
 			     int sz, int *tx);
+static int uhci_tx_chain (struct uhci_eop_info *ue, int token, void *buf,
+			  int sz, int *tx);
+static int chain_stop_index (struct usb_wait *w);
 
 
 static int uhci_process_completed (struct uhci_info *ui);
@@ -245,6 +252,9 @@ static void uhci_run_unlocked (struct uhci_info *ui);
 #define uhci_port_enabled(x, y) (pci_reg_read16((x)->io, (y)) & USB_PORT_ENABLE)
 static void uhci_add_td_to_qh (struct queue_head *qh,
 			       struct tx_descriptor *td);
+static void uhci_add_tds_to_qh (struct queue_head *qh,
+				struct tx_descriptor *first,
+				struct tx_descriptor *last);
 static void uhci_remove_error_td (struct tx_descriptor *td);
 static void uhci_setup_td (struct tx_descriptor *td, int dev_addr, int token,
 			   int eop, void *pkt, int sz, int toggle, bool ls);
@@ -531,39 +541,154 @@ static int
 uhci_tx_pkt_bulk (struct uhci_eop_info *ue, int token, void *buf,
 		  int sz, int *tx)
 {
-  /* XXX this can be made to use async packets */
-  int bytes = 0;
   int txed = 0;
+  int err = USB_HOST_ERR_NONE;
 
-  /* send data in max_pkt sized chunks */
-  while (bytes < sz)
+  /* send data in chains of up to TD_MAX_CHAIN max_pkt sized packets */
+  while (txed < sz)
     {
-      int to_tx, pkt_txed;
-      int left;
-      int err;
-      bool wait_on_pkt;
-
-      left = sz - bytes;
-      to_tx = (left > ue->maxpkt) ? ue->maxpkt : left;
-      wait_on_pkt = (left <= to_tx) ? true : false;
-
-      pkt_txed = 0;
-      err = uhci_tx_pkt (ue, token, buf + bytes, 0, to_tx, &pkt_txed, 
-			 wait_on_pkt);
-      if (err)
-	{
-	  if (tx != NULL)
-	    *tx = txed;
-	  return err;
-	}
-      txed += pkt_txed;
-      bytes += pkt_txed;
+      int to_tx, chain_txed;
+
+      to_tx = sz - txed;
+      if (to_tx > TD_MAX_CHAIN * ue->maxpkt)
+	to_tx = TD_MAX_CHAIN * ue->maxpkt;
+
+      err = uhci_tx_chain (ue, token, buf + txed, to_tx, &chain_txed);
+      txed += chain_txed;
+      if (err || chain_txed < to_tx)
+	break;
     }
 
   if (tx != NULL)
     *tx = txed;
 
-  return USB_HOST_ERR_NONE;
+  return err;
+}
+
+/**
+ * Queue one TD per packet for SZ bytes at BUF, linked depth first so
+ * that the controller moves as many packets per frame as the bus allows,
+ * and wait for the interrupt that reports the chain done.
+ * Short packet detection stops the chain early on a short IN packet.
+ */
+static int
+uhci_tx_chain (struct uhci_eop_info *ue, int token, void *buf, int sz,
+	       int *tx)
+{
+  struct tx_descriptor *tds[TD_MAX_CHAIN];
+  enum intr_level old_lvl;
+  struct uhci_dev_info *ud;
+  struct usb_wait w;
+  int td_cnt, stop;
+  int err;
+  int i;
+
+  ud = ue->ud;
+  td_cnt = DIV_ROUND_UP (sz, ue->maxpkt);
+  ASSERT (td_cnt > 0 && td_cnt <= TD_MAX_CHAIN);
+
+  uhci_lock (ud->ui);
+
+  for (i = 0; i < td_cnt; i++)
+    {
+      int ofs = i * ue->maxpkt;
+      int len = (sz - ofs > ue->maxpkt) ? ue->maxpkt : sz - ofs;
+      struct tx_descriptor *td;
+
+      td = tds[i] = uhci_acquire_td (ud->ui);
+      memset (td, 0, sizeof (struct tx_descriptor));
+      uhci_setup_td (td, ud->dev_addr, token, ue->eop, buf + ofs, len,
+		     ue->toggle ^ (i & 1), ud->low_speed);
+      td->control.spd = (token == USB_TOKEN_IN);
+      td->control.ioc = 1;
+      td->flags = TD_FL_USED;
+
+      if (i > 0)
+	{
+	  tds[i - 1]->flp.flp = ptr_to_flp (vtop (td));
+	  tds[i - 1]->flp.depth_select = 1;
+	  tds[i - 1]->flp.terminate = 0;
+	}
+    }
+
+  w.td = tds[td_cnt - 1];
+  w.tds = tds;
+  w.td_cnt = td_cnt;
+  w.ud = ud;
+  sema_init (&w.sem, 0);
+
+  uhci_stop (ud->ui);
+
+  uhci_add_tds_to_qh (ud->qh, tds[0], tds[td_cnt - 1]);
+  list_push_back (&ud->ui->waiting, &w.peers);
+
+  /* reactivate controller and wait */
+  old_lvl = intr_disable ();
+  uhci_run (ud->ui);
+  uhci_unlock (ud->ui);
+  sema_down (&w.sem);
+  intr_set_level (old_lvl);
+
+  /* count what made it, up to the TD that stopped the chain */
+  stop = chain_stop_index (&w);
+  *tx = 0;
+  for (i = 0; i < td_cnt && i <= stop; i++)
+    if (!tds[i]->control.active)
+      *tx += (tds[i]->control.actual_len + 1) & 0x7ff;
+
+  err = USB_HOST_ERR_NONE;
+  if (stop < td_cnt)
+    {
+      struct td_control *c = &tds[stop]->control;
+      if (c->bitstuff)
+	err = USB_HOST_ERR_BITSTUFF;
+      else if (c->timeout)
+	err = USB_HOST_ERR_TIMEOUT;
+      else if (c->nak)
+	err = USB_HOST_ERR_NAK;
+      else if (c->babble)
+	err = USB_HOST_ERR_BABBLE;
+      else if (c->buffer_error)
+	err = USB_HOST_ERR_BUFFER;
+      else if (c->stalled)
+	err = USB_HOST_ERR_STALL;
+    }
+
+  /* the toggle moves on with every packet that was acknowledged */
+  if (err == USB_HOST_ERR_NONE)
+    ue->toggle = tds[stop < td_cnt ? stop : td_cnt - 1]->token.data_toggle ^ 1;
+  else
+    ue->toggle = tds[stop]->token.data_toggle;
+
+  for (i = 0; i < td_cnt; i++)
+    uhci_release_td (ud->ui, tds[i]);
+
+  return err;
+}
+
+/**
+ * Returns the index of the TD that ended chain W early, because it
+ * failed or got a short packet, or the chain length if none did.
+ * Returns -1 if the chain is still running.
+ */
+static int
+chain_stop_index (struct usb_wait *w)
+{
+  int i;
+
+  for (i = 0; i < w->td_cnt; i++)
+    {
+      struct tx_descriptor *td = w->tds[i];
+      if (td->control.active)
+	return -1;
+      if (td->control.stalled || td->control.error_limit == 0
+	  || td->control.babble || td->control.buffer_error
+	  || td->control.bitstuff || td->control.timeout)
+	return i;
+      if (((td->control.actual_len + 1) & 0x7ff) < td->token.maxlen + 1u)
+	return i;
+    }
+  return w->td_cnt;
 }
 
 static int
@@ -655,6 +780,8 @@ uhci_tx_pkt_wait (struct uhci_eop_info *ue, int token, void *pkt,
   td->control.ioc = 1;
 
   w.td = td;
+  w.tds = NULL;
+  w.td_cnt = 1;
   w.ud = ud;
   sema_init (&w.sem, 0);
 
@@ -719,19 +846,31 @@ uhci_tx_pkt_wait (struct uhci_eop_info *ue, int token, void *pkt,
 
 static void
 uhci_add_td_to_qh (struct queue_head *qh, struct tx_descriptor *td)
+{
+  uhci_add_tds_to_qh (qh, td, td);
+}
+
+/* append the chain of TDs from FIRST to LAST to the end of QH */
+static void
+uhci_add_tds_to_qh (struct queue_head *qh, struct tx_descriptor *first,
+		    struct tx_descriptor *last)
 {
   struct frame_list_ptr *fp;
+  struct tx_descriptor *td;
+
+  ASSERT (first != NULL && last != NULL);
 
-  ASSERT (td != NULL);
+  for (td = first; td != last; td = ptov (flp_to_ptr (td->flp.flp)))
+    td->head = &qh->qelp;
+  last->head = &qh->qelp;
 
-  td->head = &qh->qelp;
   if (qh->qelp.terminate == 1)
     {
       /* queue is empty */
-      td->flp.terminate = 1;
+      last->flp.terminate = 1;
       barrier ();
-      td->flp.flp = 0;
-      qh->qelp.flp = ptr_to_flp (vtop (td));
+      last->flp.flp = 0;
+      qh->qelp.flp = ptr_to_flp (vtop (first));
       qh->qelp.terminate = 0;
     }
   else
@@ -745,11 +884,11 @@ uhci_add_td_to_qh (struct queue_head *qh, struct tx_descriptor *td)
 	}
 
       /* set TD to terminated ptr */
-      td->flp = *fp;
+      last->flp = *fp;
 
       fp->qh_select = 0;
       fp->depth_select = 0;
-      fp->flp = ptr_to_flp (vtop (td));
+      fp->flp = ptr_to_flp (vtop (first));
       barrier ();
       fp->terminate = 0;
     }
@@ -807,7 +946,22 @@ uhci_process_completed (struct uhci_info *ui)
       next = list_next (li);
       uw = list_entry (li, struct usb_wait, peers);
 
-      if (!uw->td->control.active)
+      if (uw->tds != NULL)
+	{
+	  /* a chain is done when every TD completed or one stopped it;
+	     unlink the TDs the controller did not get through */
+	  int stop = chain_stop_index (uw);
+	  if (stop >= 0)
+	    {
+	      int i;
+	      list_remove (li);
+	      for (i = stop; i < uw->td_cnt; i++)
+		uhci_remove_error_td (uw->tds[i]);
+	      sema_up (&uw->sem);
+	      completed++;
+	    }
+	}
+      else if (!uw->td->control.active)
 	{
 	  list_remove (li);
 	  if (uw->td->control.error_limit == 0 || uw->td->control.stalled)
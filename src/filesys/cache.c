@@ -0,0 +1,459 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "devices/timer.h"
+
+/* Number of sectors held in the buffer cache. */
+#define CACHE_SIZE 64
+
+/* Milliseconds between write-behind flushes. */
+#define WRITE_BEHIND_MS 1000
+
+/* Maximum number of sectors waiting to be read ahead. */
+#define READ_AHEAD_QUEUE_SIZE 32
+
+/* Maximum number of consecutive sectors read ahead with a single
+   request. */
+#define READ_AHEAD_RUN 16
+
+/* A cached sector.
+
+   SECTOR, IN_USE, ACCESSED and PIN_CNT are protected by
+   cache_lock.  DATA and DIRTY are protected by LOCK, which is
+   also held while the entry's sector is being read from or
+   written to disk.  An entry with a nonzero PIN_CNT is never
+   chosen for eviction, so its SECTOR is stable while pinned. */
+struct cache_entry
+  {
+    block_sector_t sector;              /* Sector held in DATA. */
+    bool in_use;                        /* Does DATA hold a sector? */
+    bool accessed;                      /* Used since the clock hand passed? */
+    bool dirty;                         /* Must DATA be written back? */
+    int pin_cnt;                        /* Number of threads using entry. */
+    struct lock lock;                   /* Protects DATA and DIRTY. */
+    uint8_t *data;                      /* BLOCK_SECTOR_SIZE bytes. */
+  };
+
+static struct cache_entry cache[CACHE_SIZE];
+static struct lock cache_lock;          /* Protects entry bookkeeping. */
+static struct condition cache_unpinned; /* Signaled when a pin drops. */
+static size_t clock_hand;               /* Next eviction candidate. */
+
+/* Sectors queued for the read-ahead thread, as a circular
+   buffer of read_ahead_cnt entries starting at read_ahead_head. */
+static block_sector_t read_ahead_queue[READ_AHEAD_QUEUE_SIZE];
+static size_t read_ahead_head;
+static size_t read_ahead_cnt;
+static struct lock read_ahead_lock;     /* Protects the queue. */
+static struct condition read_ahead_avail; /* Signaled when queue grows. */
+
+static struct cache_entry *cache_evict (bool wait);
+static struct cache_entry *cache_get (block_sector_t, bool load);
+static void cache_put (struct cache_entry *);
+static void cache_unpin (struct cache_entry *);
+static thread_func write_behind_daemon NO_RETURN;
+static thread_func read_ahead_daemon NO_RETURN;
+
+/* Initializes the buffer cache and starts the write-behind and
+   read-ahead threads. */
+void
+cache_init (void)
+{
+  uint8_t *data;
+  size_t i;
+
+  data = palloc_get_multiple (PAL_ASSERT,
+                              CACHE_SIZE * BLOCK_SECTOR_SIZE / PGSIZE);
+  lock_init (&cache_lock);
+  cond_init (&cache_unpinned);
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      e->in_use = false;
+      e->accessed = false;
+      e->dirty = false;
+      e->pin_cnt = 0;
+      lock_init (&e->lock);
+      e->data = data + i * BLOCK_SECTOR_SIZE;
+    }
+  clock_hand = 0;
+
+  read_ahead_head = read_ahead_cnt = 0;
+  lock_init (&read_ahead_lock);
+  cond_init (&read_ahead_avail);
+
+  thread_create ("write-behind", PRI_DEFAULT, write_behind_daemon, NULL);
+  thread_create ("read-ahead", PRI_DEFAULT, read_ahead_daemon, NULL);
+}
+
+/* Writes every dirty sector back to disk.  Called at file system
+   shutdown. */
+void
+cache_done (void)
+{
+  cache_flush ();
+}
+
+/* Writes every dirty cached sector to the file system device.
+   Dirty sectors that are adjacent on disk are written back with
+   a single request. */
+void
+cache_flush (void)
+{
+  struct cache_entry *pinned[CACHE_SIZE];
+  struct block_iovec iov[CACHE_SIZE];
+  size_t pinned_cnt = 0;
+  size_t i, j;
+
+  /* Pin every cached sector, sorted by sector number. */
+  lock_acquire (&cache_lock);
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      if (!e->in_use)
+        continue;
+      e->pin_cnt++;
+      for (j = pinned_cnt++; j > 0 && pinned[j - 1]->sector > e->sector; j--)
+        pinned[j] = pinned[j - 1];
+      pinned[j] = e;
+    }
+  lock_release (&cache_lock);
+
+  /* Lock each run of dirty entries that hold consecutive
+     sectors, in sector order, and write it back.  Locking in
+     sector order keeps concurrent flushes from deadlocking. */
+  for (i = 0; i < pinned_cnt; )
+    {
+      block_sector_t start = pinned[i]->sector;
+      size_t cnt = 0;
+
+      while (i + cnt < pinned_cnt && pinned[i + cnt]->sector == start + cnt)
+        {
+          struct cache_entry *e = pinned[i + cnt];
+
+          lock_acquire (&e->lock);
+          if (!e->dirty)
+            {
+              lock_release (&e->lock);
+              break;
+            }
+          iov[cnt].buffer = e->data;
+          iov[cnt].sector_cnt = 1;
+          cnt++;
+        }
+
+      if (cnt == 0)
+        {
+          /* PINNED[I] is clean. */
+          cache_unpin (pinned[i++]);
+          continue;
+        }
+      block_writev (fs_device, start, iov, cnt);
+      for (j = 0; j < cnt; j++)
+        {
+          pinned[i]->dirty = false;
+          cache_put (pinned[i++]);
+        }
+    }
+}
+
+/* Reads sector SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read (block_sector_t sector, void *buffer)
+{
+  cache_read_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads SIZE bytes starting at byte SECTOR_OFS within sector
+   SECTOR into BUFFER. */
+void
+cache_read_at (block_sector_t sector, void *buffer,
+               int sector_ofs, int size)
+{
+  struct cache_entry *e;
+
+  ASSERT (sector_ofs >= 0 && size >= 0);
+  ASSERT (sector_ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, true);
+  memcpy (buffer, e->data + sector_ofs, size);
+  cache_put (e);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER into sector
+   SECTOR.  The sector reaches the disk when it is evicted or
+   flushed. */
+void
+cache_write (block_sector_t sector, const void *buffer)
+{
+  cache_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes from BUFFER into sector SECTOR, starting at
+   byte SECTOR_OFS within the sector.  The rest of the sector is
+   preserved. */
+void
+cache_write_at (block_sector_t sector, const void *buffer,
+                int sector_ofs, int size)
+{
+  struct cache_entry *e;
+
+  ASSERT (sector_ofs >= 0 && size >= 0);
+  ASSERT (sector_ofs + size <= BLOCK_SECTOR_SIZE);
+
+  /* A write that covers the whole sector need not read the old
+     contents first. */
+  e = cache_get (sector, size < BLOCK_SECTOR_SIZE);
+  memcpy (e->data + sector_ofs, buffer, size);
+  e->dirty = true;
+  cache_put (e);
+}
+
+/* Asks the read-ahead thread to bring SECTOR into the cache in
+   the background.  This is only a hint: it is dropped if too
+   many sectors are already waiting to be read. */
+void
+cache_read_ahead (block_sector_t sector)
+{
+  lock_acquire (&read_ahead_lock);
+  if (read_ahead_cnt < READ_AHEAD_QUEUE_SIZE)
+    {
+      size_t tail = (read_ahead_head + read_ahead_cnt) % READ_AHEAD_QUEUE_SIZE;
+      read_ahead_queue[tail] = sector;
+      read_ahead_cnt++;
+      cond_signal (&read_ahead_avail, &read_ahead_lock);
+    }
+  lock_release (&read_ahead_lock);
+}
+
+/* Returns the cached entry for SECTOR, searching with cache_lock
+   held.  Returns a null pointer if SECTOR is not cached. */
+static struct cache_entry *
+cache_lookup (block_sector_t sector)
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+  for (i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].in_use && cache[i].sector == sector)
+      return &cache[i];
+  return NULL;
+}
+
+/* Chooses an unpinned entry to reuse, using the clock algorithm,
+   and writes it back to disk if it is dirty.  If all of the
+   entries are pinned, waits for one to be unpinned if WAIT is
+   true, or returns a null pointer otherwise.
+   Must be called with cache_lock held.  The write-back happens
+   under cache_lock so that no other thread can look up the
+   victim's old sector and read stale data from disk. */
+static struct cache_entry *
+cache_evict (bool wait)
+{
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  for (;;)
+    {
+      size_t i;
+
+      /* Two sweeps suffice: the first clears accessed bits, the
+         second is then sure to find an unpinned entry if there
+         is one. */
+      for (i = 0; i < 2 * CACHE_SIZE; i++)
+        {
+          struct cache_entry *e = &cache[clock_hand];
+          clock_hand = (clock_hand + 1) % CACHE_SIZE;
+
+          if (e->pin_cnt > 0)
+            continue;
+          if (!e->in_use)
+            return e;
+          if (e->accessed)
+            {
+              e->accessed = false;
+              continue;
+            }
+
+          if (e->dirty)
+            {
+              lock_acquire (&e->lock);
+              block_write (fs_device, e->sector, e->data);
+              e->dirty = false;
+              lock_release (&e->lock);
+            }
+          e->in_use = false;
+          return e;
+        }
+      if (!wait)
+        return NULL;
+      cond_wait (&cache_unpinned, &cache_lock);
+    }
+}
+
+/* Returns the entry for SECTOR, pinned and with its lock held.
+   If SECTOR is not yet cached, an entry is evicted to make room
+   and, if LOAD is true, filled from disk.  If LOAD is false the
+   caller must overwrite the entire sector. */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool load)
+{
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  e = cache_lookup (sector);
+  if (e != NULL)
+    {
+      e->pin_cnt++;
+      e->accessed = true;
+      lock_release (&cache_lock);
+      lock_acquire (&e->lock);
+      return e;
+    }
+
+  e = cache_evict (true);
+  e->sector = sector;
+  e->in_use = true;
+  e->accessed = true;
+  e->dirty = false;
+  e->pin_cnt = 1;
+
+  /* Lock the entry before publishing it, so that other threads
+     looking up SECTOR wait until it has been read. */
+  lock_acquire (&e->lock);
+  lock_release (&cache_lock);
+
+  if (load)
+    block_read (fs_device, sector, e->data);
+  return e;
+}
+
+/* Unlocks and unpins E, which was returned by cache_get(). */
+static void
+cache_put (struct cache_entry *e)
+{
+  lock_release (&e->lock);
+  cache_unpin (e);
+}
+
+/* Unpins E, whose lock the caller does not hold. */
+static void
+cache_unpin (struct cache_entry *e)
+{
+  lock_acquire (&cache_lock);
+  ASSERT (e->pin_cnt > 0);
+  if (--e->pin_cnt == 0)
+    cond_signal (&cache_unpinned, &cache_lock);
+  lock_release (&cache_lock);
+}
+
+/* Periodically writes dirty sectors back to disk, so that data
+   does not sit in the cache indefinitely.  Pending free map
+   changes are pushed into the cache first, so that each pass
+   leaves the free map on disk consistent with the inodes. */
+static void
+write_behind_daemon (void *aux UNUSED)
+{
+  for (;;)
+    {
+      timer_msleep (WRITE_BEHIND_MS);
+      free_map_flush ();
+      cache_flush ();
+    }
+}
+
+/* Brings the CNT sectors starting at START into the cache, if
+   they are not there already, reading sectors that are adjacent
+   on disk with a single request.  Sectors that are already
+   cached, or for which no entry is free, are skipped. */
+static void
+cache_read_run (block_sector_t start, size_t cnt)
+{
+  struct cache_entry *run[READ_AHEAD_RUN];
+  bool fresh[READ_AHEAD_RUN];
+  struct block_iovec iov[READ_AHEAD_RUN];
+  size_t i;
+
+  ASSERT (cnt <= READ_AHEAD_RUN);
+
+  /* Claim an entry for each sector that is not cached.  Waiting
+     for an entry here, while holding the locks of the entries
+     already claimed, could deadlock with cache_flush(). */
+  lock_acquire (&cache_lock);
+  for (i = 0; i < cnt; i++)
+    {
+      struct cache_entry *e = NULL;
+
+      fresh[i] = cache_lookup (start + i) == NULL;
+      if (fresh[i])
+        e = cache_evict (false);
+      if (e != NULL)
+        {
+          e->sector = start + i;
+          e->in_use = true;
+          e->accessed = true;
+          e->dirty = false;
+          e->pin_cnt = 1;
+          lock_acquire (&e->lock);
+        }
+      else
+        fresh[i] = false;
+      run[i] = e;
+    }
+  lock_release (&cache_lock);
+
+  /* Read each group of claimed sectors with one request. */
+  for (i = 0; i < cnt; )
+    {
+      size_t n = 0;
+
+      while (i + n < cnt && fresh[i + n])
+        {
+          iov[n].buffer = run[i + n]->data;
+          iov[n].sector_cnt = 1;
+          n++;
+        }
+      if (n > 0)
+        block_readv (fs_device, start + i, iov, n);
+      for (; n > 0; n--, i++)
+        cache_put (run[i]);
+      if (i < cnt && !fresh[i])
+        i++;
+    }
+}
+
+/* Reads queued sectors into the cache, so that they are present
+   by the time a sequential reader asks for them.  Runs of
+   consecutive queued sectors are read together. */
+static void
+read_ahead_daemon (void *aux UNUSED)
+{
+  for (;;)
+    {
+      block_sector_t start;
+      size_t cnt;
+
+      lock_acquire (&read_ahead_lock);
+      while (read_ahead_cnt == 0)
+        cond_wait (&read_ahead_avail, &read_ahead_lock);
+      start = read_ahead_queue[read_ahead_head];
+      cnt = 0;
+      do
+        {
+          read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_QUEUE_SIZE;
+          read_ahead_cnt--;
+          cnt++;
+        }
+      while (read_ahead_cnt > 0 && cnt < READ_AHEAD_RUN
+             && read_ahead_queue[read_ahead_head] == start + cnt);
+      lock_release (&read_ahead_lock);
+
+      cache_read_run (start, cnt);
+    }
+}
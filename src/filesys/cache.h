@@ -0,0 +1,16 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include "devices/block.h"
+
+void cache_init (void);
+void cache_done (void);
+void cache_flush (void);
+
+void cache_read (block_sector_t, void *);
+void cache_read_at (block_sector_t, void *, int sector_ofs, int size);
+void cache_write (block_sector_t, const void *);
+void cache_write_at (block_sector_t, const void *, int sector_ofs, int size);
+void cache_read_ahead (block_sector_t);
+
+#endif /* filesys/cache.h */
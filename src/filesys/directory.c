@@ -1,7 +1,10 @@
 #include "filesys/directory.h"
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
@@ -21,12 +24,118 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* On-disk directory layout.
+
+   A directory is a hash table of file names.  Its first
+   BLOCK_SECTOR_SIZE bytes hold a struct dir_header.  Each
+   following sector-sized block holds a struct dir_bucket: first
+   the BUCKET_CNT primary buckets, indexed by the hash of the
+   name, and then overflow buckets, each chained from a full
+   bucket with the same hash.  Looking up a name thus normally
+   touches just the header and one bucket.  When the table
+   becomes too full it is rebuilt with twice as many buckets. */
+
+/* Identifies a directory header. */
+#define DIR_MAGIC 0x44495248
+
+/* Number of entries in a bucket. */
+#define DIR_BUCKET_ENTRIES \
+  ((BLOCK_SECTOR_SIZE - sizeof (uint32_t)) / sizeof (struct dir_entry))
+
+/* Directory header, in block 0. */
+struct dir_header
+  {
+    unsigned magic;                     /* DIR_MAGIC. */
+    uint32_t bucket_cnt;                /* Number of primary buckets. */
+    uint32_t block_cnt;                 /* Blocks in use, incl. header. */
+    uint32_t entry_cnt;                 /* Number of entries in use. */
+  };
+
+/* A hash bucket, one per block. */
+struct dir_bucket
+  {
+    uint32_t next;                      /* Overflow bucket block, or 0. */
+    struct dir_entry entries[DIR_BUCKET_ENTRIES]; /* Entries. */
+  };
+
+/* Returns the byte offset within a directory of entry SLOT in
+   the bucket in block BLOCK. */
+static off_t
+entry_ofs (uint32_t block, size_t slot)
+{
+  return (block * BLOCK_SECTOR_SIZE + offsetof (struct dir_bucket, entries)
+          + slot * sizeof (struct dir_entry));
+}
+
+/* Returns the block of the primary bucket for NAME in a
+   directory with header H. */
+static uint32_t
+home_bucket (const struct dir_header *h, const char *name)
+{
+  return 1 + hash_string (name) % h->bucket_cnt;
+}
+
+/* Reads DIR's header into *H.  Returns true if successful. */
+static bool
+read_header (const struct dir *dir, struct dir_header *h)
+{
+  return (inode_read_at (dir->inode, h, sizeof *h, 0) == sizeof *h
+          && h->magic == DIR_MAGIC);
+}
+
+/* Writes *H as DIR's header.  Returns true if successful. */
+static bool
+write_header (struct dir *dir, const struct dir_header *h)
+{
+  return inode_write_at (dir->inode, h, sizeof *h, 0) == sizeof *h;
+}
+
+/* Reads the bucket in block BLOCK of DIR into *B.
+   Returns true if successful. */
+static bool
+read_bucket (const struct dir *dir, uint32_t block, struct dir_bucket *b)
+{
+  return (inode_read_at (dir->inode, b, sizeof *b, block * BLOCK_SECTOR_SIZE)
+          == sizeof *b);
+}
+
+/* Writes an empty bucket to block BLOCK of DIR.
+   Returns true if successful. */
+static bool
+clear_bucket (struct dir *dir, uint32_t block)
+{
+  static struct dir_bucket empty;
+  return (inode_write_at (dir->inode, &empty, sizeof empty,
+                          block * BLOCK_SECTOR_SIZE)
+          == sizeof empty);
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  struct dir_header h;
+  struct dir *dir;
+  bool success;
+
+  /* Start out at most half full, the load at which the table
+     grows.  The buckets start out zeroed, that is, empty. */
+  h.magic = DIR_MAGIC;
+  h.bucket_cnt = DIV_ROUND_UP (entry_cnt * 2, DIR_BUCKET_ENTRIES);
+  if (h.bucket_cnt == 0)
+    h.bucket_cnt = 1;
+  h.block_cnt = 1 + h.bucket_cnt;
+  h.entry_cnt = 0;
+
+  if (!inode_create (sector, h.block_cnt * BLOCK_SECTOR_SIZE))
+    return false;
+  dir = dir_open (inode_open (sector));
+  if (dir == NULL)
+    return false;
+  success = write_header (dir, &h);
+  dir_close (dir);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -92,23 +201,170 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
-  struct dir_entry e;
-  size_t ofs;
+  struct dir_header h;
+  struct dir_bucket *b;
+  uint32_t block;
+  bool found = false;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
-      }
-  return false;
+  b = malloc (sizeof *b);
+  if (b == NULL || !read_header (dir, &h))
+    {
+      free (b);
+      return false;
+    }
+
+  for (block = home_bucket (&h, name); block != 0 && !found;
+       block = b->next)
+    {
+      size_t i;
+
+      if (!read_bucket (dir, block, b))
+        break;
+      for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+        if (b->entries[i].in_use && !strcmp (name, b->entries[i].name)) 
+          {
+            if (ep != NULL)
+              *ep = b->entries[i];
+            if (ofsp != NULL)
+              *ofsp = entry_ofs (block, i);
+            found = true;
+            break;
+          }
+    }
+  free (b);
+  return found;
+}
+
+/* Stores E in a free slot in the hash chain for E's name in DIR,
+   whose header is *H, appending an overflow bucket if the chain
+   is full.  B is scratch space.  If MAY_GROW is true and the
+   chain is full, instead returns false without storing E if DIR
+   is at least half full, so that the caller can grow the table.
+   Updates *H but does not write it back.
+   Returns true if successful, false on failure. */
+static bool
+insert_entry (struct dir *dir, struct dir_header *h,
+              const struct dir_entry *e, struct dir_bucket *b,
+              bool may_grow)
+{
+  uint32_t block = home_bucket (h, e->name);
+
+  for (;;)
+    {
+      size_t i;
+
+      if (!read_bucket (dir, block, b))
+        return false;
+      for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+        if (!b->entries[i].in_use)
+          {
+            h->entry_cnt++;
+            return (inode_write_at (dir->inode, e, sizeof *e,
+                                    entry_ofs (block, i))
+                    == sizeof *e);
+          }
+      if (b->next != 0)
+        {
+          block = b->next;
+          continue;
+        }
+
+      /* Chain is full. */
+      if (may_grow && h->entry_cnt >= h->bucket_cnt * DIR_BUCKET_ENTRIES / 2)
+        return false;
+
+      /* Add an overflow bucket at the end of the directory. */
+      b->next = h->block_cnt++;
+      if (!clear_bucket (dir, b->next)
+          || (inode_write_at (dir->inode, &b->next, sizeof b->next,
+                              block * BLOCK_SECTOR_SIZE)
+              != sizeof b->next))
+        return false;
+      block = b->next;
+    }
+}
+
+/* Returns the number of blocks, including the header, that the
+   ENTRY_CNT entries in ENTRIES take up in a table with BUCKET_CNT
+   primary buckets, counting the overflow buckets that
+   insert_entry() will chain.  Returns 0 if out of memory. */
+static uint32_t
+table_blocks (const struct dir_entry *entries, size_t entry_cnt,
+              uint32_t bucket_cnt)
+{
+  struct dir_header h;
+  uint32_t *chain_cnt;
+  uint32_t block_cnt = 1 + bucket_cnt;
+  size_t i;
+
+  chain_cnt = calloc (bucket_cnt, sizeof *chain_cnt);
+  if (chain_cnt == NULL)
+    return 0;
+  h.bucket_cnt = bucket_cnt;
+  for (i = 0; i < entry_cnt; i++)
+    chain_cnt[home_bucket (&h, entries[i].name) - 1]++;
+  for (i = 0; i < bucket_cnt; i++)
+    if (chain_cnt[i] > DIR_BUCKET_ENTRIES)
+      block_cnt += DIV_ROUND_UP (chain_cnt[i], DIR_BUCKET_ENTRIES) - 1;
+  free (chain_cnt);
+  return block_cnt;
+}
+
+/* Rebuilds DIR, whose header is *H, with twice as many primary
+   buckets, rehashing every entry.  B is scratch space.
+   Returns true if successful, false on failure.  The table is
+   rebuilt in place, so DIR is first extended to its new size;
+   if that fails, DIR is left as it was. */
+static bool
+grow_table (struct dir *dir, struct dir_header *h, struct dir_bucket *b)
+{
+  struct dir_entry *entries;
+  size_t entry_cnt = 0;
+  uint32_t block, block_cnt;
+  size_t i;
+  bool success = true;
+
+  /* Gather all the entries. */
+  entries = malloc (h->entry_cnt * sizeof *entries);
+  if (entries == NULL && h->entry_cnt > 0)
+    return false;
+  for (block = 1; block < h->block_cnt; block++)
+    {
+      if (!read_bucket (dir, block, b))
+        {
+          free (entries);
+          return false;
+        }
+      for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+        if (b->entries[i].in_use && entry_cnt < h->entry_cnt)
+          entries[entry_cnt++] = b->entries[i];
+    }
+
+  /* Allocate every block the new table needs before overwriting
+     any bucket.  Blocks past the old table hold no entries, so
+     clearing the last one is safe. */
+  block_cnt = table_blocks (entries, entry_cnt, h->bucket_cnt * 2);
+  if (block_cnt == 0
+      || (block_cnt > h->block_cnt && !clear_bucket (dir, block_cnt - 1)))
+    {
+      free (entries);
+      return false;
+    }
+
+  /* Lay out empty buckets and reinsert. */
+  h->bucket_cnt *= 2;
+  h->block_cnt = 1 + h->bucket_cnt;
+  h->entry_cnt = 0;
+  for (block = 1; success && block < h->block_cnt; block++)
+    success = clear_bucket (dir, block);
+  for (i = 0; success && i < entry_cnt; i++)
+    success = insert_entry (dir, h, &entries[i], b, false);
+  free (entries);
+
+  return success && write_header (dir, h);
 }
 
 /* Searches DIR for a file with the given NAME
@@ -124,10 +380,12 @@ dir_lookup (const struct dir *dir, const char *name,
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  inode_lock_dir (dir->inode);
   if (lookup (dir, name, &e, NULL))
     *inode = inode_open (e.inode_sector);
   else
     *inode = NULL;
+  inode_unlock_dir (dir->inode);
 
   return *inode != NULL;
 }
@@ -141,8 +399,9 @@ dir_lookup (const struct dir *dir, const char *name,
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
+  struct dir_header h;
+  struct dir_bucket *b = NULL;
   struct dir_entry e;
-  off_t ofs;
   bool success = false;
 
   ASSERT (dir != NULL);
@@ -153,28 +412,31 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
     return false;
 
   /* Check that NAME is not in use. */
+  inode_lock_dir (dir->inode);
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
-
-  /* Write slot. */
+  b = malloc (sizeof *b);
+  if (b == NULL || !read_header (dir, &h))
+    goto done;
+
+  /* Store the entry in its hash chain, growing the table first
+     if the chain is full and the table is at least half
+     full. */
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (!insert_entry (dir, &h, &e, b, true))
+    {
+      if (!grow_table (dir, &h, b)
+          || !insert_entry (dir, &h, &e, b, false))
+        goto done;
+    }
+  success = write_header (dir, &h);
 
  done:
+  inode_unlock_dir (dir->inode);
+  free (b);
   return success;
 }
 
@@ -184,6 +446,7 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 bool
 dir_remove (struct dir *dir, const char *name) 
 {
+  struct dir_header h;
   struct dir_entry e;
   struct inode *inode = NULL;
   bool success = false;
@@ -193,6 +456,7 @@ dir_remove (struct dir *dir, const char *name)
   ASSERT (name != NULL);
 
   /* Find directory entry. */
+  inode_lock_dir (dir->inode);
   if (!lookup (dir, name, &e, &ofs))
     goto done;
 
@@ -205,12 +469,18 @@ dir_remove (struct dir *dir, const char *name)
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
+  if (read_header (dir, &h))
+    {
+      h.entry_cnt--;
+      write_header (dir, &h);
+    }
 
   /* Remove inode. */
   inode_remove (inode);
   success = true;
 
  done:
+  inode_unlock_dir (dir->inode);
   inode_close (inode);
   return success;
 }
@@ -221,16 +491,40 @@ dir_remove (struct dir *dir, const char *name)
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
+  struct dir_header h;
   struct dir_entry e;
+  bool success = false;
+
+  inode_lock_dir (dir->inode);
+  if (!read_header (dir, &h))
+    goto done;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
+  /* DIR->POS is the offset of the next entry to examine.  Walk
+     the slots of every bucket in block order, skipping each
+     bucket's chain pointer. */
+  if (dir->pos < entry_ofs (1, 0))
+    dir->pos = entry_ofs (1, 0);
+  while ((uint32_t) (dir->pos / BLOCK_SECTOR_SIZE) < h.block_cnt)
     {
-      dir->pos += sizeof e;
+      uint32_t block = dir->pos / BLOCK_SECTOR_SIZE;
+      size_t slot = ((dir->pos % BLOCK_SECTOR_SIZE
+                      - offsetof (struct dir_bucket, entries))
+                     / sizeof e);
+
+      if (inode_read_at (dir->inode, &e, sizeof e, dir->pos) != sizeof e)
+        break;
+      dir->pos = (slot + 1 < DIR_BUCKET_ENTRIES
+                  ? entry_ofs (block, slot + 1)
+                  : entry_ofs (block + 1, 0));
       if (e.in_use)
         {
           strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
+          success = true;
+          break;
         } 
     }
-  return false;
+
+ done:
+  inode_unlock_dir (dir->inode);
+  return success;
 }
@@ -1,8 +1,15 @@
 #include "filesys/file.h"
 #include <debug.h>
+#include "devices/block.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
+/* Bounds on the read-ahead window of a sequentially read file,
+   in bytes.  The window starts at the minimum and doubles with
+   each further sequential read. */
+#define READ_AHEAD_MIN (2 * BLOCK_SECTOR_SIZE)
+#define READ_AHEAD_MAX (16 * BLOCK_SECTOR_SIZE)
+
 /* An open file. */
 struct file 
   {
@@ -11,8 +18,13 @@ struct file
     bool delete;
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    off_t ra_next;              /* Where a sequential read would start. */
+    off_t ra_window;            /* Read-ahead window, 0 if not sequential. */
+    off_t ra_end;               /* End of data already read ahead. */
   };
 
+static void file_read_ahead (struct file *, off_t size);
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
@@ -72,9 +84,46 @@ file_read (struct file *file, void *buffer, off_t size)
 {
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
   file->pos += bytes_read;
+  file_read_ahead (file, bytes_read);
   return bytes_read;
 }
 
+/* Updates FILE's read-ahead state after a read of SIZE bytes
+   that ended at the file's current position.  If the read
+   continued where the previous one left off, grows the
+   read-ahead window and starts reading the data past the
+   current position that is not already on its way into the
+   buffer cache.  Any other read drops the window. */
+static void
+file_read_ahead (struct file *file, off_t size)
+{
+  bool sequential = file->pos - size == file->ra_next;
+  off_t end;
+
+  if (size == 0)
+    return;
+
+  file->ra_next = file->pos;
+  if (!sequential)
+    {
+      file->ra_window = 0;
+      file->ra_end = 0;
+      return;
+    }
+
+  if (file->ra_window == 0)
+    file->ra_window = READ_AHEAD_MIN;
+  else if (file->ra_window < READ_AHEAD_MAX)
+    file->ra_window *= 2;
+
+  end = file->pos + file->ra_window;
+  if (file->ra_end < file->pos)
+    file->ra_end = file->pos;
+  if (end > file->ra_end)
+    inode_read_ahead (file->inode, file->ra_end, end - file->ra_end);
+  file->ra_end = end;
+}
+
 /* Reads SIZE bytes from FILE into BUFFER,
    starting at offset FILE_OFS in the file.
    Returns the number of bytes actually read,
@@ -89,9 +138,8 @@ file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs)
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at the file's current position.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk is full.
+   Writing past end of file extends the file.
    Advances FILE's position by the number of bytes read. */
 off_t
 file_write (struct file *file, const void *buffer, off_t size) 
@@ -104,9 +152,8 @@ file_write (struct file *file, const void *buffer, off_t size)
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at offset FILE_OFS in the file.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk is full.
+   Writing past end of file extends the file.
    The file's current position is unaffected. */
 off_t
 file_write_at (struct file *file, const void *buffer, off_t size,
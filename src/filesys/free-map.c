@@ -1,12 +1,43 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Number of free map bits stored in one sector of the free map
+   file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Number of sectors in an allocation group. */
+#define GROUP_SECTORS 1024
+
+/* Summary of the free space in one allocation group, which lets
+   the allocator skip groups that cannot satisfy a request
+   without looking at their bits. */
+struct free_group
+  {
+    size_t free_cnt;                 /* Number of free sectors. */
+    size_t longest_run;              /* Longest run of free sectors. */
+  };
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct lock free_map_lock;    /* Protects the free map. */
+
+/* One bit per sector of the free map file, set if that part of
+   the free map has changed since it was last written. */
+static struct bitmap *free_map_dirty;
+
+/* Free space summary for each group of GROUP_SECTORS sectors. */
+static struct free_group *groups;
+static size_t group_cnt;
+
+static void mark_dirty (block_sector_t, size_t);
+static void summarize_groups (block_sector_t, size_t);
 
 /* Initializes the free map. */
 void
@@ -15,26 +46,149 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  free_map_dirty = bitmap_create (DIV_ROUND_UP (block_size (fs_device),
+                                                BITS_PER_SECTOR));
+  if (free_map_dirty == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  group_cnt = DIV_ROUND_UP (block_size (fs_device), GROUP_SECTORS);
+  groups = malloc (group_cnt * sizeof *groups);
+  if (groups == NULL)
+    PANIC ("free map group allocation failed");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  summarize_groups (0, bitmap_size (free_map));
+}
+
+/* Returns the first sector past the end of group G. */
+static block_sector_t
+group_end (size_t g)
+{
+  size_t end = (g + 1) * GROUP_SECTORS;
+  return end < bitmap_size (free_map) ? end : bitmap_size (free_map);
+}
+
+/* Recomputes the summary of every group that holds any of the
+   CNT sectors starting at SECTOR. */
+static void
+summarize_groups (block_sector_t sector, size_t cnt)
+{
+  size_t g;
+
+  if (cnt == 0)
+    return;
+  for (g = sector / GROUP_SECTORS; g <= (sector + cnt - 1) / GROUP_SECTORS;
+       g++)
+    {
+      struct free_group *grp = &groups[g];
+      block_sector_t end = group_end (g);
+      block_sector_t i;
+      size_t run = 0;
+
+      grp->free_cnt = 0;
+      grp->longest_run = 0;
+      for (i = g * GROUP_SECTORS; i < end; i++)
+        if (bitmap_test (free_map, i))
+          run = 0;
+        else
+          {
+            grp->free_cnt++;
+            if (++run > grp->longest_run)
+              grp->longest_run = run;
+          }
+    }
+}
+
+/* Searches for CNT free sectors in a row between sectors START
+   and END, and returns the first one, or BITMAP_ERROR if there
+   is no such run. */
+static block_sector_t
+scan_range (block_sector_t start, block_sector_t end, size_t cnt)
+{
+  size_t run = 0;
+
+  for (; start < end; start++)
+    if (bitmap_test (free_map, start))
+      run = 0;
+    else if (++run == cnt)
+      return start - cnt + 1;
+  return BITMAP_ERROR;
+}
+
+/* Marks the parts of the free map that hold CNT bits starting at
+   SECTOR as needing to be written. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  if (cnt > 0)
+    bitmap_set_multiple (free_map_dirty, first, last - first + 1, true);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available.
+   The change reaches the free map file at the next call to
+   free_map_flush(). */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (cnt, 0, sectorp);
+}
+
+/* Like free_map_allocate(), but prefers the CNT sectors to start
+   at or soon after sector GOAL.  Callers pass the sector just
+   past related data, such as the end of a file being extended
+   or the inode of a parent directory, to keep related data close
+   together on disk.
+
+   Searches GOAL's group from GOAL onward and then each following
+   group, wrapping around, skipping groups whose summary shows
+   they have no free run of CNT sectors.  Only requests that no
+   single group can satisfy fall back to scanning the whole free
+   map. */
+bool
+free_map_allocate_near (size_t cnt, block_sector_t goal,
+                        block_sector_t *sectorp)
+{
+  block_sector_t sector = BITMAP_ERROR;
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  if (goal >= bitmap_size (free_map))
+    goal = 0;
+  if (cnt <= GROUP_SECTORS)
+    for (i = 0; i <= group_cnt && sector == BITMAP_ERROR; i++)
+      {
+        size_t g = (goal / GROUP_SECTORS + i) % group_cnt;
+        block_sector_t start = g * GROUP_SECTORS;
+
+        /* Visit GOAL's group twice: first from GOAL onward, and
+           last, after all the others, from its beginning. */
+        if (i == 0)
+          start = goal;
+        if (groups[g].longest_run >= cnt)
+          sector = scan_range (start, group_end (g), cnt);
+      }
+  if (sector == BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      /* Runs that cross group boundaries are not summarized. */
+      sector = bitmap_scan (free_map, goal, cnt, false);
+      if (sector == BITMAP_ERROR)
+        sector = bitmap_scan (free_map, 0, cnt, false);
     }
+  if (sector != BITMAP_ERROR)
+    {
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      summarize_groups (sector, cnt);
+      mark_dirty (sector, cnt);
+    }
+  lock_release (&free_map_lock);
+
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
@@ -44,9 +198,34 @@ free_map_allocate (size_t cnt, block_sector_t *sectorp)
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  summarize_groups (sector, cnt);
+  mark_dirty (sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Writes the parts of the free map that have changed since they
+   were last written to the free map file.  Called periodically
+   by the buffer cache's write-behind thread, just before it
+   flushes the cache, and when the free map is closed. */
+void
+free_map_flush (void)
+{
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for (i = 0; i < bitmap_size (free_map_dirty); i++)
+      if (bitmap_test (free_map_dirty, i))
+        {
+          if (!bitmap_write_bytes (free_map, free_map_file,
+                                   i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE))
+            PANIC ("can't write free map");
+          bitmap_reset (free_map_dirty, i);
+        }
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,12 +237,14 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  summarize_groups (0, bitmap_size (free_map));
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  free_map_flush ();
   file_close (free_map_file);
 }
 
@@ -82,4 +263,5 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (free_map_dirty, false);
 }
@@ -1,23 +1,62 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
+#include <stddef.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Number of extents stored in the inode itself and in each
+   indirect extent block. */
+#define DIRECT_EXTENT_CNT 61
+#define INDIRECT_EXTENT_CNT 63
+
+/* A run of consecutive data sectors on disk. */
+struct inode_extent
+  {
+    block_sector_t start;               /* First sector. */
+    block_sector_t length;              /* Number of sectors. */
+  };
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   A file's data is a sequence of extents.  The first
+   DIRECT_EXTENT_CNT are stored here; the rest are stored in a
+   chain of indirect extent blocks starting at INDIRECT. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint32_t extent_cnt;                /* Number of extents in file. */
+    block_sector_t indirect;            /* First indirect block, or 0. */
+    struct inode_extent extents[DIRECT_EXTENT_CNT]; /* Direct extents. */
+    uint32_t unused[2];                 /* Not used. */
+  };
+
+/* On-disk indirect extent block.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct inode_indirect
+  {
+    block_sector_t next;                /* Next indirect block, or 0. */
+    struct inode_extent extents[INDIRECT_EXTENT_CNT]; /* Extents. */
+    uint32_t unused;                    /* Not used. */
+  };
+
+/* An extent as kept in memory, together with its position
+   within the file. */
+struct extent
+  {
+    block_sector_t ofs;                 /* First file sector it holds. */
+    block_sector_t start;               /* First disk sector. */
+    block_sector_t length;              /* Number of sectors. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -28,17 +67,83 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* In-memory inode.
+
+   RW protects the data member, the extent list and
+   DENY_WRITE_CNT.  Readers, and writers that do not extend the
+   file, hold it shared; extending the file or changing
+   DENY_WRITE_CNT holds it exclusively.  Concurrent writes to a
+   single sector are serialized by the buffer cache.  DIR_LOCK
+   is used only by directory inodes, to serialize changes to the
+   directory's entries. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct inode_disk data;             /* Inode content. */
+
+    struct extent *extents;             /* All of the file's extents. */
+    size_t extent_cap;                  /* Allocated size of EXTENTS. */
+    block_sector_t *indirect;           /* Indirect extent block sectors. */
+    size_t indirect_cnt;                /* Number of indirect blocks. */
+
+    struct rwlock rw;                   /* Protects file data, see above. */
+    struct lock dir_lock;               /* Serializes directory changes. */
   };
 
+/* Returns the number of data sectors allocated to INODE. */
+static block_sector_t
+allocated_sectors (const struct inode *inode)
+{
+  const struct extent *last;
+
+  if (inode->data.extent_cnt == 0)
+    return 0;
+  last = &inode->extents[inode->data.extent_cnt - 1];
+  return last->ofs + last->length;
+}
+
+/* Returns the disk sector where INODE's next data sector would
+   best be placed: just past its last extent, so that the file
+   can grow in place, or just past the inode itself if the file
+   has no data yet. */
+static block_sector_t
+next_sector_goal (const struct inode *inode)
+{
+  const struct extent *last;
+
+  if (inode->data.extent_cnt == 0)
+    return inode->sector + 1;
+  last = &inode->extents[inode->data.extent_cnt - 1];
+  return last->start + last->length;
+}
+
+/* Returns the disk sector that holds file sector IDX of INODE,
+   which must be less than the number of sectors allocated to
+   INODE.  Uses a binary search over INODE's extents. */
+static block_sector_t
+extent_lookup (const struct inode *inode, block_sector_t idx)
+{
+  size_t lo = 0;
+  size_t hi = inode->data.extent_cnt;
+
+  ASSERT (idx < allocated_sectors (inode));
+
+  /* Find the last extent starting at or before IDX. */
+  while (hi - lo > 1)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (inode->extents[mid].ofs <= idx)
+        lo = mid;
+      else
+        hi = mid;
+    }
+  return inode->extents[lo].start + (idx - inode->extents[lo].ofs);
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
@@ -48,20 +153,272 @@ byte_to_sector (const struct inode *inode, off_t pos)
 {
   ASSERT (inode != NULL);
   if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
+    return extent_lookup (inode, pos / BLOCK_SECTOR_SIZE);
   else
     return -1;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes, keyed by sector, so that opening a single inode
+   twice returns the same `struct inode'. */
+static struct hash open_inodes;
+
+/* Protects open_inodes and the open_cnt member of every open
+   inode. */
+static struct lock open_inodes_lock;
+
+static hash_hash_func inode_hash;
+static hash_less_func inode_less;
+static struct inode *open_inode_lookup (block_sector_t);
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  hash_init (&open_inodes, inode_hash, inode_less, NULL);
+  lock_init (&open_inodes_lock);
+}
+
+/* Returns a hash value for the inode that contains E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, elem);
+  return hash_bytes (&inode->sector, sizeof inode->sector);
+}
+
+/* Returns true if the inode that contains A precedes the one
+   that contains B. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
+}
+
+/* Reads INODE's extents, including those in indirect blocks,
+   into memory.  Returns true if successful, false if memory
+   allocation fails. */
+static bool
+load_extents (struct inode *inode)
+{
+  size_t cnt = inode->data.extent_cnt;
+  struct inode_indirect *block = NULL;
+  block_sector_t next = inode->data.indirect;
+  block_sector_t ofs = 0;
+  size_t i;
+
+  inode->extents = NULL;
+  inode->extent_cap = 0;
+  inode->indirect = NULL;
+  inode->indirect_cnt = 0;
+  if (cnt == 0)
+    return true;
+
+  inode->extents = malloc (cnt * sizeof *inode->extents);
+  if (cnt > DIRECT_EXTENT_CNT)
+    {
+      size_t indirect_cnt = DIV_ROUND_UP (cnt - DIRECT_EXTENT_CNT,
+                                          INDIRECT_EXTENT_CNT);
+      inode->indirect = malloc (indirect_cnt * sizeof *inode->indirect);
+      block = malloc (sizeof *block);
+    }
+  if (inode->extents == NULL
+      || (cnt > DIRECT_EXTENT_CNT
+          && (inode->indirect == NULL || block == NULL)))
+    {
+      free (inode->extents);
+      free (inode->indirect);
+      free (block);
+      return false;
+    }
+  inode->extent_cap = cnt;
+
+  for (i = 0; i < cnt; i++)
+    {
+      const struct inode_extent *d;
+
+      if (i < DIRECT_EXTENT_CNT)
+        d = &inode->data.extents[i];
+      else
+        {
+          size_t slot = (i - DIRECT_EXTENT_CNT) % INDIRECT_EXTENT_CNT;
+          if (slot == 0)
+            {
+              inode->indirect[inode->indirect_cnt++] = next;
+              cache_read (next, block);
+              next = block->next;
+            }
+          d = &block->extents[slot];
+        }
+
+      inode->extents[i].ofs = ofs;
+      inode->extents[i].start = d->start;
+      inode->extents[i].length = d->length;
+      ofs += d->length;
+    }
+  free (block);
+  return true;
+}
+
+/* Frees the in-memory copy of INODE's extents. */
+static void
+free_extents (struct inode *inode)
+{
+  free (inode->extents);
+  free (inode->indirect);
+}
+
+/* Writes extent IDX of INODE to disk, along with the inode
+   itself. */
+static void
+save_extent (struct inode *inode, size_t idx)
+{
+  struct inode_extent d;
+
+  d.start = inode->extents[idx].start;
+  d.length = inode->extents[idx].length;
+  if (idx < DIRECT_EXTENT_CNT)
+    inode->data.extents[idx] = d;
+  else
+    {
+      size_t i = idx - DIRECT_EXTENT_CNT;
+      cache_write_at (inode->indirect[i / INDIRECT_EXTENT_CNT], &d,
+                      offsetof (struct inode_indirect, extents)
+                      + i % INDIRECT_EXTENT_CNT * sizeof d,
+                      sizeof d);
+    }
+  cache_write (inode->sector, &inode->data);
+}
+
+/* Adds an empty indirect extent block to the end of INODE's
+   chain.  Returns true if successful, false if memory or disk
+   allocation fails. */
+static bool
+add_indirect_block (struct inode *inode)
+{
+  static struct inode_indirect empty;
+  block_sector_t *indirect;
+  block_sector_t sector;
+
+  indirect = realloc (inode->indirect,
+                      (inode->indirect_cnt + 1) * sizeof *indirect);
+  if (indirect == NULL)
+    return false;
+  inode->indirect = indirect;
+  if (!free_map_allocate_near (1, next_sector_goal (inode), &sector))
+    return false;
+
+  cache_write (sector, &empty);
+  if (inode->indirect_cnt == 0)
+    {
+      inode->data.indirect = sector;
+      cache_write (inode->sector, &inode->data);
+    }
+  else
+    cache_write_at (inode->indirect[inode->indirect_cnt - 1], &sector,
+                    offsetof (struct inode_indirect, next), sizeof sector);
+  inode->indirect[inode->indirect_cnt++] = sector;
+  return true;
+}
+
+/* Appends the LENGTH sectors starting at START to the end of
+   INODE's data, extending the last extent if they directly
+   follow it.  Returns true if successful, false if memory or
+   disk allocation fails. */
+static bool
+append_extent (struct inode *inode, block_sector_t start,
+               block_sector_t length)
+{
+  size_t cnt = inode->data.extent_cnt;
+  struct extent *e;
+
+  if (cnt > 0)
+    {
+      e = &inode->extents[cnt - 1];
+      if (e->start + e->length == start)
+        {
+          e->length += length;
+          save_extent (inode, cnt - 1);
+          return true;
+        }
+    }
+
+  if (cnt == inode->extent_cap)
+    {
+      size_t cap = inode->extent_cap > 0 ? inode->extent_cap * 2 : 4;
+      struct extent *extents = realloc (inode->extents,
+                                        cap * sizeof *extents);
+      if (extents == NULL)
+        return false;
+      inode->extents = extents;
+      inode->extent_cap = cap;
+    }
+  if (cnt >= DIRECT_EXTENT_CNT
+      && (cnt - DIRECT_EXTENT_CNT) % INDIRECT_EXTENT_CNT == 0
+      && !add_indirect_block (inode))
+    return false;
+
+  e = &inode->extents[cnt];
+  e->ofs = allocated_sectors (inode);
+  e->start = start;
+  e->length = length;
+  inode->data.extent_cnt++;
+  save_extent (inode, cnt);
+  return true;
+}
+
+/* Allocates data sectors for INODE until it has room for LENGTH
+   bytes, zeroing each new sector.  Allocates runs that are as
+   long as possible, starting just past the current last extent
+   if there is room, so that files stay mostly contiguous even
+   on a fragmented disk.
+   Returns true if successful, false if memory or disk
+   allocation fails, in which case INODE keeps whatever sectors
+   were added. */
+static bool
+inode_grow (struct inode *inode, off_t length)
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+  size_t have = allocated_sectors (inode);
+  size_t need = bytes_to_sectors (length);
+
+  while (have < need)
+    {
+      size_t cnt = need - have;
+      block_sector_t start;
+      size_t i;
+
+      while (!free_map_allocate_near (cnt, next_sector_goal (inode),
+                                      &start))
+        {
+          cnt /= 2;
+          if (cnt == 0)
+            return false;
+        }
+      if (!append_extent (inode, start, cnt))
+        {
+          free_map_release (start, cnt);
+          return false;
+        }
+      for (i = 0; i < cnt; i++)
+        cache_write (start + i, zeros);
+      have += cnt;
+    }
+  return true;
+}
+
+/* Releases all of INODE's data sectors and indirect blocks to
+   the free map. */
+static void
+release_sectors (struct inode *inode)
+{
+  size_t i;
+
+  for (i = 0; i < inode->data.extent_cnt; i++)
+    free_map_release (inode->extents[i].start, inode->extents[i].length);
+  for (i = 0; i < inode->indirect_cnt; i++)
+    free_map_release (inode->indirect[i], 1);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -72,35 +429,32 @@ inode_init (void)
 bool
 inode_create (block_sector_t sector, off_t length)
 {
-  struct inode_disk *disk_inode = NULL;
+  struct inode *inode = NULL;
   bool success = false;
 
   ASSERT (length >= 0);
 
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
-  ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof inode->data == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct inode_indirect) == BLOCK_SECTOR_SIZE);
 
-  disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
+  inode = calloc (1, sizeof *inode);
+  if (inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
-      disk_inode->length = length;
-      disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start)) 
+      inode->sector = sector;
+      inode->data.magic = INODE_MAGIC;
+      cache_write (sector, &inode->data);
+      if (inode_grow (inode, length))
         {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0) 
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
+          inode->data.length = length;
+          cache_write (sector, &inode->data);
           success = true; 
-        } 
-      free (disk_inode);
+        }
+      else
+        release_sectors (inode);
+      free_extents (inode);
+      free (inode);
     }
   return success;
 }
@@ -111,33 +465,66 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct hash_elem *e;
   struct inode *inode;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
-    {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
-    }
+  inode = open_inode_lookup (sector);
+  if (inode != NULL)
+    return inode;
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
     return NULL;
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize.  The disk is read without holding
+     open_inodes_lock, so another thread may open the same inode
+     in the meantime, in which case we use its copy instead. */
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  rwlock_init (&inode->rw);
+  lock_init (&inode->dir_lock);
+  cache_read (inode->sector, &inode->data);
+  if (!load_extents (inode))
+    {
+      free (inode);
+      return NULL;
+    }
+
+  lock_acquire (&open_inodes_lock);
+  e = hash_insert (&open_inodes, &inode->elem);
+  if (e != NULL)
+    {
+      free_extents (inode);
+      free (inode);
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+    }
+  lock_release (&open_inodes_lock);
+  return inode;
+}
+
+/* Returns the open inode for SECTOR, reopened, or a null pointer
+   if SECTOR is not open. */
+static struct inode *
+open_inode_lookup (block_sector_t sector)
+{
+  static struct inode key;
+  struct hash_elem *e;
+  struct inode *inode = NULL;
+
+  lock_acquire (&open_inodes_lock);
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
+    {
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+    }
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -146,7 +533,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -163,24 +554,30 @@ inode_get_inumber (const struct inode *inode)
 void
 inode_close (struct inode *inode) 
 {
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  /* Release resources if this was the last opener.  Once the
+     inode is out of open_inodes no other thread can reach it. */
+  lock_acquire (&open_inodes_lock);
+  last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
       /* Deallocate blocks if removed. */
       if (inode->removed) 
         {
           free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
+          release_sectors (inode);
         }
 
+      free_extents (inode);
       free (inode); 
     }
 }
@@ -202,8 +599,8 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
 
+  rwlock_acquire_read (&inode->rw);
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
@@ -220,100 +617,114 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      cache_read_at (sector_idx, buffer + bytes_read, sector_ofs, chunk_size);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+  rwlock_release_read (&inode->rw);
 
   return bytes_read;
 }
 
+/* Starts reading the SIZE bytes of INODE that begin at OFFSET
+   into the buffer cache in the background, without waiting for
+   them.  Bytes past end of file are ignored. */
+void
+inode_read_ahead (struct inode *inode, off_t offset, off_t size)
+{
+  off_t end = offset + size;
+
+  rwlock_acquire_read (&inode->rw);
+  if (end > inode_length (inode))
+    end = inode_length (inode);
+
+  offset = ROUND_DOWN (offset, BLOCK_SECTOR_SIZE);
+  for (; offset < end; offset += BLOCK_SECTOR_SIZE)
+    cache_read_ahead (byte_to_sector (inode, offset));
+  rwlock_release_read (&inode->rw);
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if an error occurs.  A write past end of file
+   extends the inode; any gap between the old end of file and
+   OFFSET reads back as zeros. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  off_t end = offset + size;
+  bool extend;
 
-  if (inode->deny_write_cnt)
+  /* An empty write must not extend the file even if OFFSET lies
+     past its end. */
+  if (size <= 0)
     return 0;
 
-  while (size > 0) 
+  /* Only a write that extends the file needs INODE to itself.
+     Files never shrink, so a write that starts out within the
+     file stays within it. */
+  extend = end > inode_length (inode);
+  if (extend)
+    rwlock_acquire_write (&inode->rw);
+  else
+    rwlock_acquire_read (&inode->rw);
+
+  if (inode->deny_write_cnt)
+    goto done;
+
+  /* Make room for data past end of file.  If that fails, write
+     as much as fits in the sectors that could be allocated. */
+  if (end > inode_length (inode) && !inode_grow (inode, end))
     {
-      /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      off_t capacity = (off_t) allocated_sectors (inode) * BLOCK_SECTOR_SIZE;
+      if (end > capacity)
+        end = capacity;
+    }
+
+  while (offset < end) 
+    {
+      /* Sector to write, starting byte offset within sector.
+         The sector may lie past end of file, so look it up
+         directly rather than through byte_to_sector(). */
+      block_sector_t sector_idx = extent_lookup (inode,
+                                                 offset / BLOCK_SECTOR_SIZE);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      /* Bytes left to write, bytes left in sector, lesser of the
+         two. */
+      off_t write_left = end - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      int chunk_size = write_left < sector_left ? write_left : sector_left;
 
-      /* Number of bytes to actually write into this sector. */
-      int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0)
-        break;
-
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
-        }
-      else 
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
-        }
+      /* The cache reads in the rest of the sector if the chunk
+         does not cover all of it. */
+      cache_write_at (sector_idx, buffer + bytes_written,
+                      sector_ofs, chunk_size);
 
       /* Advance. */
-      size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
 
+  /* Publish the new length only once the data is in place, so
+     that readers never see unwritten bytes. */
+  if (offset > inode_length (inode))
+    {
+      inode->data.length = offset;
+      cache_write (inode->sector, &inode->data);
+    }
+
+ done:
+  if (extend)
+    rwlock_release_write (&inode->rw);
+  else
+    rwlock_release_read (&inode->rw);
   return bytes_written;
 }
 
@@ -322,8 +733,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rw);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  rwlock_release_write (&inode->rw);
 }
 
 /* Re-enables writes to INODE.
@@ -332,9 +745,28 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rw);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  rwlock_release_write (&inode->rw);
+}
+
+/* Acquires the lock that serializes operations on the entries
+   of directory INODE.  Held across a whole directory operation,
+   such as a lookup followed by an insertion, so that other
+   directories can be changed at the same time. */
+void
+inode_lock_dir (struct inode *inode)
+{
+  lock_acquire (&inode->dir_lock);
+}
+
+/* Releases the lock acquired by inode_lock_dir(). */
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -42,6 +42,8 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/raid0.h"
+#include "devices/ramdisk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -60,6 +62,15 @@ static const char *scratch_bdev_name;
 #ifdef VM
 static const char *swap_bdev_name;
 #endif
+
+/* -ramdisk: Size of RAM disk in kB, or 0 for none. */
+static size_t ramdisk_kb;
+
+/* -raid0, -stripe: Names of block devices to stripe across,
+   separated by commas, or null for none, and stripe unit size in
+   kB. */
+static char *raid0_members;
+static unsigned raid0_stripe_kb = 64;
 #endif /* FILESYS */
 
 /* -ul: Maximum number of pages to put into palloc's user pool. */
@@ -137,6 +148,9 @@ main (void)
   /* Initialize file system. */
   usb_storage_init ();
   ide_init ();
+  ramdisk_init (ramdisk_kb);
+  if (raid0_members != NULL)
+    raid0_init (raid0_members, raid0_stripe_kb);
   locate_block_devices ();
   filesys_init (format_filesys);
 #endif
@@ -285,6 +299,20 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-iosched"))
+        {
+          if (value == NULL || !block_set_default_scheduler (value))
+            PANIC ("unknown I/O scheduler `%s' (use -h for help)",
+                   value != NULL ? value : "");
+        }
+      else if (!strcmp (name, "-iotrace"))
+        block_trace_enable ();
+      else if (!strcmp (name, "-ramdisk"))
+        ramdisk_kb = value != NULL ? atoi (value) : 0;
+      else if (!strcmp (name, "-raid0"))
+        raid0_members = value;
+      else if (!strcmp (name, "-stripe"))
+        raid0_stripe_kb = value != NULL ? atoi (value) : 0;
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -411,6 +439,13 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -iosched=NAME      Schedule disk I/O with NAME: fifo, clook or\n"
+          "                     deadline (the default).\n"
+          "  -iotrace           Trace disk I/O to scratch device at power off.\n"
+          "  -ramdisk=KB        Create a KB kB RAM disk named ram0, for use\n"
+          "                     with -filesys, -scratch or -swap.\n"
+          "  -raid0=BDEV,...    Stripe BDEVs into a RAID-0 device named md0.\n"
+          "  -stripe=KB         Use KB kB stripe units for md0 (default 64).\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -406,6 +406,7 @@ cond_wait (struct condition *cond, struct lock *lock)
   ASSERT (lock_held_by_current_thread (lock));
   
   sema_init (&waiter.semaphore, 0);
+  waiter.effective = thread_current ()->effective;
   list_insert_ordered (&cond->waiters, &waiter.elem, cond_effective_less,
 		       NULL);
   lock_release (lock);
@@ -430,25 +431,11 @@ cond_signal (struct condition *cond, struct lock *lock UNUSED)
 
   if (!list_empty (&cond->waiters))
     {
-    int old_level = intr_disable ();
-    
-    struct list_elem *e = list_begin (&cond->waiters);
+    /* Use the priority each waiter recorded in cond_wait(), since
+       a waiter may not have blocked on its semaphore yet. */
+    struct list_elem *e = list_max (&cond->waiters, cond_effective_less,
+                                    NULL);
     struct semaphore_elem *sema = list_entry (e, struct semaphore_elem, elem);
-    int max = list_entry (list_front (&(&sema->semaphore)->waiters),
-			  struct thread, elem)->effective;
-    for (; e != list_end (&cond->waiters); e = list_next (e)) {
-      struct semaphore_elem *sema_temp = 
-	list_entry (e, struct semaphore_elem, elem);
-      struct thread *t =
-	list_entry (list_front (&(&sema_temp->semaphore)->waiters), 
-		    struct thread, elem);
-      
-      if(max < t->effective) {
-	max = t->effective;
-	sema =  sema_temp;
-      }
-    }
-    intr_set_level (old_level);
     list_remove(&sema->elem);
     sema_up(&sema->semaphore);      
   }
@@ -469,3 +456,71 @@ cond_broadcast (struct condition *cond, struct lock *lock)
   while (!list_empty (&cond->waiters))
     cond_signal (cond, lock);
 }
+
+/* Initializes RW as a readers-writer lock, which may be held by
+   any number of readers at once or by a single writer.  Waiting
+   writers keep new readers out, so that a steady stream of
+   readers cannot starve them. */
+void
+rwlock_init (struct rwlock *rw)
+{
+  ASSERT (rw != NULL);
+
+  lock_init (&rw->lock);
+  cond_init (&rw->can_read);
+  cond_init (&rw->can_write);
+  rw->reader_cnt = 0;
+  rw->waiting_writers = 0;
+  rw->writing = false;
+}
+
+/* Acquires RW for reading, sleeping until no writer holds or is
+   waiting for it. */
+void
+rwlock_acquire_read (struct rwlock *rw)
+{
+  lock_acquire (&rw->lock);
+  while (rw->writing || rw->waiting_writers > 0)
+    cond_wait (&rw->can_read, &rw->lock);
+  rw->reader_cnt++;
+  lock_release (&rw->lock);
+}
+
+/* Releases RW, which the current thread holds for reading. */
+void
+rwlock_release_read (struct rwlock *rw)
+{
+  lock_acquire (&rw->lock);
+  ASSERT (rw->reader_cnt > 0);
+  if (--rw->reader_cnt == 0)
+    cond_signal (&rw->can_write, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Acquires RW for writing, sleeping until no other thread holds
+   it. */
+void
+rwlock_acquire_write (struct rwlock *rw)
+{
+  lock_acquire (&rw->lock);
+  rw->waiting_writers++;
+  while (rw->writing || rw->reader_cnt > 0)
+    cond_wait (&rw->can_write, &rw->lock);
+  rw->waiting_writers--;
+  rw->writing = true;
+  lock_release (&rw->lock);
+}
+
+/* Releases RW, which the current thread holds for writing. */
+void
+rwlock_release_write (struct rwlock *rw)
+{
+  lock_acquire (&rw->lock);
+  ASSERT (rw->writing);
+  rw->writing = false;
+  if (rw->waiting_writers > 0)
+    cond_signal (&rw->can_write, &rw->lock);
+  else
+    cond_broadcast (&rw->can_read, &rw->lock);
+  lock_release (&rw->lock);
+}
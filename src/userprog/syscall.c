@@ -11,8 +11,6 @@
 #include <console.h>
 #include <devices/input.h>
 
-struct lock sys_file_io;
-
 static void syscall_handler (struct intr_frame *);
 static void sys_halt (void);
 //static int sys_exit (int status);
@@ -35,7 +33,6 @@ static void sys_close (int fd);
 void
 syscall_init (void) 
 {
-  lock_init(&sys_file_io);
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
 }
 
@@ -137,11 +134,7 @@ sys_create (const char *file, unsigned initial_size)
   if (!valid_ptr((void *)file))
     sys_exit (-1);
 
-  lock_acquire(&sys_file_io);
-  bool result = filesys_create (file, initial_size);
-  lock_release(&sys_file_io);
-
-  return result;
+  return filesys_create (file, initial_size);
 }
 
 static int sys_open (const char *file)
@@ -156,9 +149,7 @@ static int sys_open (const char *file)
   for (; i < 128; i++)
     if (t->fd_table[i] == NULL)
       {
-	lock_acquire(&sys_file_io);
 	f = filesys_open (file);
-	lock_release(&sys_file_io);
 	if (f == NULL)
 	  return -1;
 
@@ -226,12 +217,7 @@ sys_remove (const char *file)
     return false;
 
   if (file != NULL)
-    {
-      lock_acquire(&sys_file_io);
-      bool result = filesys_remove (file);
-      lock_release(&sys_file_io);
-      return result;
-    }
+    return filesys_remove (file);
   return false;
 }
   
@@ -264,12 +250,7 @@ sys_read (int fd, void *buffer, unsigned length)
 
   struct file *file = get_file (fd, false);
   if (file != NULL)
-    {
-      lock_acquire(&sys_file_io);
-      int result = file_read (file, buffer, length);
-      lock_release(&sys_file_io);
-      return result;
-    }
+    return file_read (file, buffer, length);
   return -1;
 }
 
@@ -290,12 +271,7 @@ sys_write (int fd, const void *buffer, unsigned length)
 
   struct file *file = get_file (fd, false);
   if (file != NULL)
-    {
-      lock_acquire(&sys_file_io);
-      int result = file_write(file, buffer, length);
-      lock_release(&sys_file_io);
-      return result;
-    }
+    return file_write(file, buffer, length);
   return 0;
 }
 
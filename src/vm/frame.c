@@ -5,125 +5,431 @@
 #include "threads/malloc.h"
 #include "threads/thread.h"
 #include <stdio.h>
+#include <string.h>
 #include "threads/palloc.h"
 #include "vm/vm.h"
 
 //void remove_frame_entry(void *frame);
-struct frame_table_entry* get_frame_entry(void *frame);
 struct frame_table_entry* create_frame_entry(void* frame, struct sup_page_table_entry* entry);
-void evict_frame(struct frame_table_entry* entry);
+void evict_frames(struct frame_table_entry** victims, size_t cnt);
 struct frame_table_entry* clock_evict(void);
+static void page_cleaner(void* aux UNUSED);
+
+//The frame table: one entry per page in the user pool, indexed by
+//the frame's position in the pool.
+static struct frame_table_entry* frames;
+static size_t frame_cnt;
+static uint8_t* user_base;
+
+//Index of the next entry the clock looks at. It keeps its place
+//between evictions instead of starting over at the first frame.
+static size_t clock_hand;
+
+//Signalled whenever an eviction finishes writing out its page.
+static struct condition eviction_done;
+
+//Clean frames that the page cleaner has already evicted, ready to
+//be handed to a faulting thread once the user pool runs dry. The
+//cleaner refills the reserve to the high watermark whenever it
+//drops below the low one.
+#define RESERVE_LOW 8
+#define RESERVE_HIGH 32
+static struct frame_table_entry* reserve[RESERVE_HIGH];
+static size_t reserve_cnt;
+static size_t reserve_low, reserve_high;
+static struct semaphore cleaner_sema;
+static bool cleaner_wanted;
+
+//Most pages written to or read from swap with one request.
+#define SWAP_CLUSTER 8
 
 //Initialize the frame table
-void 
+void
 frame_table_init(void)
 {
-  list_init(&frame_table);
+  void* base;
+  palloc_user_pool(&base, &frame_cnt);
+  user_base = base;
+  frames = calloc(frame_cnt, sizeof *frames);
+  if(frames == NULL)
+    PANIC("frame table allocation failed");
   lock_init(&frame_table_lock);
+  cond_init(&eviction_done);
+  clock_hand = 0;
   swap_init();
+  share_init();
+
+  //Leave most of a small user pool to the processes themselves.
+  reserve_high = frame_cnt / 4 < RESERVE_HIGH ? frame_cnt / 4 : RESERVE_HIGH;
+  reserve_low = reserve_high / 4 < RESERVE_LOW ? reserve_high / 4 : RESERVE_LOW;
+  reserve_cnt = 0;
+  sema_init(&cleaner_sema, 0);
+  cleaner_wanted = false;
+  if(reserve_high > 0)
+    thread_create("page-cleaner", PRI_DEFAULT, page_cleaner, NULL);
+}
+
+//Background page cleaner. Once woken, evicts frames with the clock
+//and writes out the dirty ones until the reserve holds
+//reserve_high clean frames, so that faulting threads rarely have to
+//write someone else's page before they can read their own. Victims
+//are evicted up to SWAP_CLUSTER at a time so that their write-out
+//is a single request.
+static void
+page_cleaner(void* aux UNUSED)
+{
+  for(;;)
+  {
+    sema_down(&cleaner_sema);
+    for(;;)
+    {
+      struct frame_table_entry* victims[SWAP_CLUSTER];
+      size_t want, cnt, i;
+
+      lock_acquire(&frame_table_lock);
+      want = reserve_cnt < reserve_high ? reserve_high - reserve_cnt : 0;
+      if(want > SWAP_CLUSTER)
+        want = SWAP_CLUSTER;
+      lock_release(&frame_table_lock);
+
+      for(cnt = 0; cnt < want; cnt++)
+      {
+        victims[cnt] = clock_evict();
+        if(victims[cnt] == NULL)
+          break;
+      }
+      if(cnt == 0)
+      {
+        lock_acquire(&frame_table_lock);
+        cleaner_wanted = false;
+        lock_release(&frame_table_lock);
+        break;
+      }
+      evict_frames(victims, cnt);
+
+      lock_acquire(&frame_table_lock);
+      for(i = 0; i < cnt; i++)
+      {
+        victims[i]->thread = NULL;
+        victims[i]->page = NULL;
+        reserve[reserve_cnt++] = victims[i];
+      }
+      lock_release(&frame_table_lock);
+    }
+  }
+}
+
+//Take a clean frame from the reserve, waking the page cleaner if
+//the reserve is running low. Returns NULL if the reserve is empty.
+static struct frame_table_entry*
+take_reserved_frame(void)
+{
+  struct frame_table_entry* frame = NULL;
+  bool wake = false;
+
+  lock_acquire(&frame_table_lock);
+  if(reserve_cnt > 0)
+    frame = reserve[--reserve_cnt];
+  if(reserve_cnt < reserve_low && !cleaner_wanted && reserve_high > 0)
+    wake = cleaner_wanted = true;
+  lock_release(&frame_table_lock);
+  if(wake)
+    sema_up(&cleaner_sema);
+  return frame;
 }
 
-//Allocates a frame. Wrapper for palloc_get_page
+//Gets a frame from the user pool only, leaving the page cleaner's
+//reserve to pages that are actually needed. For pages read in
+//speculatively. Returns the frame pinned, or NULL if the pool is
+//empty.
 struct frame_table_entry*
-allocate_frame(enum palloc_flags flags, struct sup_page_table_entry* entry)
+get_pool_frame(enum palloc_flags flags, struct sup_page_table_entry* entry)
 {
   void* frame = palloc_get_page(flags);
-  
-  struct frame_table_entry* frame_entry;
-  if(frame != NULL)
-    frame_entry = create_frame_entry(frame, entry);
-  else
+  return frame != NULL ? create_frame_entry(frame, entry) : NULL;
+}
+
+//Gets a frame from the user pool or, if that is empty, from the
+//page cleaner's reserve, without evicting anything. Returns the
+//frame pinned, or NULL if neither has one.
+struct frame_table_entry*
+get_free_frame(enum palloc_flags flags, struct sup_page_table_entry* entry)
+{
+  struct frame_table_entry* frame_entry = get_pool_frame(flags, entry);
+  if(frame_entry != NULL)
+    return frame_entry;
+
+  frame_entry = take_reserved_frame();
+  if(frame_entry == NULL)
+    return NULL;
+  lock_acquire(&frame_table_lock);
+  frame_entry->thread = thread_current();
+  frame_entry->page = entry;
+  lock_release(&frame_table_lock);
+  if(flags & PAL_ZERO)
+    memset(frame_entry->frame_page, 0, PGSIZE);
+  return frame_entry;
+}
+
+//Allocates a frame. Wrapper for palloc_get_page. The frame comes
+//back pinned so that it cannot be evicted while the caller fills it;
+//call unpin_frame() once it is mapped.
+struct frame_table_entry*
+allocate_frame(enum palloc_flags flags, struct sup_page_table_entry* entry)
+{
+  //Prefer a free frame or one the page cleaner has already made
+  //clean. Only if there is none, evict one ourselves and take over
+  //the victim's frame directly rather than freeing it and racing
+  //other threads for it in palloc.
+  struct frame_table_entry* frame_entry = get_free_frame(flags, entry);
+  if(frame_entry == NULL)
   {
-    struct frame_table_entry* evictee = clock_evict();
-    if(pagedir_is_dirty(evictee->thread->pagedir, evictee->page))
-      evict_frame(evictee);
-
-    void *frame = palloc_get_page(flags);
-    if(frame == NULL)
-      PANIC("Frame NULL \n");
-    frame_entry = create_frame_entry(frame, entry);
-    
+    frame_entry = clock_evict();
+    if(frame_entry == NULL)
+      PANIC("no frame to evict");
+    evict_frames(&frame_entry, 1);
+
+    lock_acquire(&frame_table_lock);
+    frame_entry->thread = thread_current();
+    frame_entry->page = entry;
+    lock_release(&frame_table_lock);
+    if(flags & PAL_ZERO)
+      memset(frame_entry->frame_page, 0, PGSIZE);
   }
   return frame_entry;
 }
 
+//Find the frame table entry of a user pool frame in constant time
+struct frame_table_entry*
+get_frame_entry(void* frame)
+{
+  size_t idx = ((uint8_t*) frame - user_base) / PGSIZE;
+  ASSERT(idx < frame_cnt);
+  return &frames[idx];
+}
+
+//Wait until any eviction of ENTRY's frame that is under way has
+//finished writing the page out. Must be called with
+//frame_table_lock held, and not by a thread that is loading ENTRY.
+void
+wait_for_eviction(struct sup_page_table_entry* entry)
+{
+  while(entry->frame != NULL && entry->frame->pinned)
+    cond_wait(&eviction_done, &frame_table_lock);
+}
+
+//Allow the clock to pick this frame again
+void
+unpin_frame(struct frame_table_entry* frame_entry)
+{
+  lock_acquire(&frame_table_lock);
+  frame_entry->pinned = false;
+  lock_release(&frame_table_lock);
+}
+
 //Frees a memory frame. Wrapper for palloc_free_page
-void 
+void
 free_frame(struct frame_table_entry* frame_entry)
 {
-  palloc_free_page(frame_entry->frame_page); 
-  free(frame_entry);
+  lock_acquire(&frame_table_lock);
+  frame_entry->thread = NULL;
+  frame_entry->page = NULL;
+  frame_entry->shared = NULL;
+  frame_entry->pinned = false;
+  lock_release(&frame_table_lock);
+  palloc_free_page(frame_entry->frame_page);
 }
 
-//Creates a frame entry and adds it to the frame table list
+//Fills in the frame table entry for a newly allocated frame
 struct frame_table_entry* create_frame_entry(void* frame, struct sup_page_table_entry* e)
 {
-  struct frame_table_entry* entry = (struct frame_table_entry*)malloc(sizeof(struct frame_table_entry));
-  
-  if(entry == NULL)
-    return NULL;
- 
+  struct frame_table_entry* entry = get_frame_entry(frame);
+
+  lock_acquire(&frame_table_lock);
   entry->thread = thread_current();
   entry->frame_page = frame;
   entry->page = e;
-  
-  lock_acquire(&frame_table_lock);
-  list_push_back(&frame_table, &entry->frame_table_elem); 
+  entry->shared = NULL;
+  entry->pinned = true;
   lock_release(&frame_table_lock);
   return entry;
 }
-//Evict the first entry that has not been accessed. If all have been 
-//accessed, remove the first entry in the frame table.
+
+//Second-chance clock. Sweep the hand over the frame table, clearing
+//the accessed bit of each recently used frame, and evict the first
+//frame whose bit is already clear. A shared frame counts as used if
+//any of its sharers used it, and is unmapped from all of them. Two
+//full sweeps always find one, unless every frame is pinned, in which
+//case this returns NULL. The victim is unmapped and returned pinned.
 struct frame_table_entry* clock_evict()
 {
-  struct frame_table_entry* evictee;
+  struct frame_table_entry* evictee = NULL;
+  size_t i;
   lock_acquire(&frame_table_lock);
-  struct list_elem* e;
-  for (e = list_begin(&frame_table); e != list_end(&frame_table); e = list_next(e))
+  for(i = 0; i < 2 * frame_cnt && evictee == NULL; i++)
   {
-    struct frame_table_entry* frame = list_entry(e, struct frame_table_entry, frame_table_elem);
-    bool accessed = pagedir_is_accessed(frame->thread->pagedir, frame->page->addr);
-    if(!accessed)
+    struct frame_table_entry* frame = &frames[clock_hand];
+    clock_hand = (clock_hand + 1) % frame_cnt;
+    if(frame->thread == NULL || frame->page == NULL || frame->pinned)
+      continue;
+    if(frame->shared != NULL)
     {
-      pagedir_clear_page(frame->thread->pagedir, frame->page->addr);
-      evictee = frame;//list_entry(e, struct frame_table_entry, frame_table_elem);
-      list_remove(e);
-      lock_release(&frame_table_lock);
-      return evictee;
+      if(!shared_page_accessed(frame->shared))
+        evictee = frame;
     }
+    else if(pagedir_is_accessed(frame->thread->pagedir, frame->page->addr))
+      pagedir_set_accessed(frame->thread->pagedir, frame->page->addr, false);
+    else
+      evictee = frame;
+  }
+  if(evictee != NULL)
+  {
+    evictee->pinned = true;
+    if(evictee->shared != NULL)
+      shared_page_unmap(evictee->shared);
+    else
+      pagedir_clear_page(evictee->thread->pagedir, evictee->page->addr);
   }
-  evictee = list_entry(list_pop_front(&frame_table), struct frame_table_entry, frame_table_elem);
-  pagedir_clear_page(evictee->thread->pagedir, evictee->page->addr);
   lock_release(&frame_table_lock);
   return evictee;
 }
-//Evict a frame by writting it to swap space and by 
-//making note of this transition in the corresponding
-//supplemental page table entry
-void evict_frame(struct frame_table_entry* entry)
+//Returns true if victim A should be written to swap before victim
+//B, that is, if it belongs to the same process at a lower address.
+static bool
+victim_less(struct frame_table_entry* a, struct frame_table_entry* b)
 {
-  size_t swap_pos = insert_into_swap(entry->frame_page);
-  entry->page->swap_table_index = swap_pos;
-  entry->page->swapped = true;
-  free_frame(entry);
+  if(a->thread != b->thread)
+    return a->thread < b->thread;
+  return a->page->addr < b->page->addr;
 }
 
-//Bring a frame back from swap space.
-bool bring_from_swap(struct sup_page_table_entry* entry)
+//Evict CNT frames, unmapped and pinned by clock_evict(), by writting
+//those whose contents can't be read back from the file to swap
+//space, and by making note of this transition in the corresponding
+//supplemental page table entries. The dirty pages are sorted by
+//process and address and written to consecutive swap slots with one
+//request, so that neighbouring pages can later be read back together.
+//The frames themselves stay allocated for the caller to reuse. Until
+//this returns each page still points at its frame, so that a fault
+//on it waits in wait_for_eviction() rather than reading stale data.
+void evict_frames(struct frame_table_entry** victims, size_t cnt)
 {
-  struct frame_table_entry* frame_entry = clock_evict();
-  evict_frame(frame_entry);
+  struct frame_table_entry* dirty[SWAP_CLUSTER];
+  void* pages[SWAP_CLUSTER];
+  size_t dirty_cnt = 0;
+  size_t i, j, n;
 
-  void* frame = palloc_get_page(PAL_USER);
+  ASSERT(cnt <= SWAP_CLUSTER);
+  for(i = 0; i < cnt; i++)
+  {
+    struct frame_table_entry* v = victims[i];
+    //Shared frames are read-only, so never dirty
+    if(v->shared != NULL || !pagedir_is_dirty(v->thread->pagedir, v->page->addr))
+      continue;
+    for(j = dirty_cnt; j > 0 && victim_less(v, dirty[j - 1]); j--)
+      dirty[j] = dirty[j - 1];
+    dirty[j] = v;
+    dirty_cnt++;
+  }
 
-  if(frame == NULL)
-    return false;
+  for(i = 0; i < dirty_cnt; i++)
+    pages[i] = dirty[i]->frame_page;
+  //If swap is too fragmented for the whole cluster, it is written
+  //in pieces as long as the longest free runs.
+  for(i = 0; i < dirty_cnt; i += n)
+  {
+    size_t swap_pos;
+    n = dirty_cnt - i;
+    swap_pos = insert_cluster_into_swap(pages + i, &n);
+    if(swap_pos == BITMAP_ERROR)
+      PANIC("swap is full");
+    for(j = 0; j < n; j++)
+    {
+      dirty[i + j]->page->swap_table_index = swap_pos + j;
+      dirty[i + j]->page->swapped = true;
+    }
+  }
 
-  retrieve_from_swap(entry->swap_table_index,frame);
-  if(!create_frame_entry(frame, entry))
-    return false;;
-  if(!pagedir_set_page(thread_current()->pagedir, entry->addr, frame, entry->writable))
-    return false;
+  struct shared_page* shared[SWAP_CLUSTER];
+  size_t shared_cnt = 0;
+  lock_acquire(&frame_table_lock);
+  for(i = 0; i < cnt; i++)
+  {
+    if(victims[i]->shared != NULL)
+    {
+      shared[shared_cnt++] = victims[i]->shared;
+      shared_page_evicted(victims[i]->shared);
+    }
+    else
+      victims[i]->page->frame = NULL;
+  }
+  cond_broadcast(&eviction_done, &frame_table_lock);
+  lock_release(&frame_table_lock);
+  for(i = 0; i < shared_cnt; i++)
+    free_shared_page(shared[i]);
+}
+
+//Returns the page after ENTRY if it was swapped out to the slot
+//after ENTRY's and is not being written out right now, so that it
+//can be read in along with ENTRY.
+static struct sup_page_table_entry*
+next_in_swap(struct sup_page_table_entry* entry)
+{
+  struct sup_page_table_entry* next = get_sup_page_entry(&thread_current()->sup_page_table, entry->addr + PGSIZE);
+  if(next == NULL)
+    return NULL;
+  lock_acquire(&frame_table_lock);
+  if(!next->swapped || next->frame != NULL || next->swap_table_index != entry->swap_table_index + 1)
+    next = NULL;
+  lock_release(&frame_table_lock);
+  return next;
+}
 
-  return true;
-} 
+//Bring a frame back from swap space. Pages that follow it in both
+//the address space and swap are read in with the same request, as
+//long as the user pool has free frames for them, and mapped as
+//well, but left unaccessed so that the clock takes them first if
+//they turn out not to be needed.
+bool bring_from_swap(struct sup_page_table_entry* entry)
+{
+  struct sup_page_table_entry* entries[SWAP_CLUSTER];
+  struct frame_table_entry* ra_frames[SWAP_CLUSTER];
+  void* pages[SWAP_CLUSTER];
+  uint32_t* pd = thread_current()->pagedir;
+  size_t cnt, i;
+  bool success = true;
+
+  entries[0] = entry;
+  ra_frames[0] = allocate_frame(PAL_USER, entry);
+  for(cnt = 1; cnt < SWAP_CLUSTER; cnt++)
+  {
+    entries[cnt] = next_in_swap(entries[cnt - 1]);
+    if(entries[cnt] == NULL)
+      break;
+    ra_frames[cnt] = get_pool_frame(PAL_USER, entries[cnt]);
+    if(ra_frames[cnt] == NULL)
+      break;
+  }
+  for(i = 0; i < cnt; i++)
+    pages[i] = ra_frames[i]->frame_page;
+
+  retrieve_cluster_from_swap(entry->swap_table_index, pages, cnt);
+  for(i = 0; i < cnt; i++)
+  {
+    entries[i]->swapped = false;
+    entries[i]->frame = ra_frames[i];
+    if(!pagedir_set_page(pd, entries[i]->addr, pages[i], entries[i]->writable))
+    {
+      entries[i]->frame = NULL;
+      free_frame(ra_frames[i]);
+      success = false;
+      continue;
+    }
+    //The swap slot is gone, so the frame now holds the only copy of
+    //the page. Mark it dirty so that it is written out if evicted.
+    pagedir_set_dirty(pd, entries[i]->addr, true);
+    unpin_frame(ra_frames[i]);
+  }
+
+  return success;
+}
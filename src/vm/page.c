@@ -5,12 +5,18 @@
 #include "threads/malloc.h"
 #include "threads/thread.h"
 #include "filesys/file.h"
+#include "filesys/inode.h"
 #include <stdio.h>
 #include <string.h>
 #include "userprog/pagedir.h"
 #include <hash.h>
 
 bool insert_entry_to_table(struct hash* table, struct sup_page_table_entry* entry);
+static bool load_page(struct sup_page_table_entry* entry);
+
+//Size of the aligned window of pages that a fault on a file-backed
+//page loads, if they are not loaded yet and frames are free.
+#define FAULT_AROUND 8
 
 void free_sup_page_entry(struct hash_elem *e, void* aux UNUSED);
 
@@ -42,6 +48,8 @@ bool create_sup_page_entry(struct file* file, off_t offset, uint8_t* page, uint3
   entry->frame = NULL;
   entry->swapped = false;
   entry->loaded = false;
+  entry->owner = thread_current();
+  entry->shared = NULL;
   if(insert_entry_to_table(&thread_current()->sup_page_table, entry))
     return true;
   else
@@ -120,14 +128,34 @@ void free_sup_page_table(struct hash* table)
 void free_sup_page_entry(struct hash_elem *e, void* aux UNUSED)
 {
   struct sup_page_table_entry* entry = hash_entry(e, struct sup_page_table_entry, elem);
-  if(entry->frame != NULL && entry->swapped != true)
+  struct shared_page* shared = NULL;
+  struct frame_table_entry* frame = NULL;
+  lock_acquire(&frame_table_lock);
+  wait_for_eviction(entry);
+  if(entry->shared != NULL)
   {
-    lock_acquire(&frame_table_lock);
-    list_remove(&entry->frame->frame_table_elem);
-    pagedir_clear_page(thread_current()->pagedir, entry->addr);
-    lock_release(&frame_table_lock);
-    free_frame(entry->frame);
+    //Only the last sharer frees a shared frame
+    shared = unshare_page(entry);
+    if(shared != NULL)
+      frame = entry->frame;
   }
+  else
+  {
+    frame = entry->frame;
+    if(frame != NULL)
+      pagedir_clear_page(thread_current()->pagedir, entry->addr);
+  }
+  //Keep the clock away from the frame until free_frame() has
+  //released it, since ENTRY is about to go away
+  if(frame != NULL)
+    frame->pinned = true;
+  lock_release(&frame_table_lock);
+  if(shared != NULL)
+    free_shared_page(shared);
+  if(frame != NULL)
+    free_frame(frame);
+  else if(entry->swapped)
+    clear_swap_entry(entry->swap_table_index);
   free(entry);
 }
 
@@ -238,23 +266,81 @@ void mmap_exit()
 //function from process.c
 bool vm_allocate(struct sup_page_table_entry* entry)
 {
+  //If the page cleaner is writing this page out, let it finish
+  lock_acquire(&frame_table_lock);
+  wait_for_eviction(entry);
+  lock_release(&frame_table_lock);
+
   if(entry->swapped == true)
   {
     return bring_from_swap(entry);
   }
-   
-  file_seek (entry->f, entry->offset);
-  //Allocate a physical page, evicting if necessary
-  struct frame_table_entry* frame = allocate_frame(PAL_USER, entry);
-  
-  entry->frame = frame;
-  uint8_t *page = frame->frame_page;
-  if (page == NULL)
-  {
+  //Code another process already has in memory needs no frame
+  if(map_shared_page(entry))
+    return true;
+
+  //Allocate a physical page, evicting if necessary, and load the
+  //faulting page before anything else
+  entry->frame = allocate_frame(PAL_USER, entry);
+  if(!load_page(entry))
     return false;
+
+  //Fault around: give the other pages of the window that come from
+  //the same file and aren't loaded yet a frame too, but only ones
+  //free in the user pool, since evicting or draining the page
+  //cleaner's reserve for pages nobody asked for would be a loss.
+  struct sup_page_table_entry* around[FAULT_AROUND];
+  size_t cnt = 0, i;
+  uint8_t* base = (uint8_t*) ((uintptr_t) entry->addr & ~(uintptr_t) (FAULT_AROUND * PGSIZE - 1));
+  off_t start = 0, end = 0;
+  for(i = 0; i < FAULT_AROUND; i++)
+  {
+    uint8_t* addr = base + i * PGSIZE;
+    if(addr == entry->addr || pagedir_get_page(thread_current()->pagedir, addr) != NULL)
+      continue;
+    struct sup_page_table_entry* e = get_sup_page_entry(&thread_current()->sup_page_table, addr);
+    if(e == NULL || e->f != entry->f)
+      continue;
+    lock_acquire(&frame_table_lock);
+    bool loadable = !e->swapped && e->frame == NULL;
+    lock_release(&frame_table_lock);
+    if(!loadable || map_shared_page(e))
+      continue;
+    e->frame = get_pool_frame(PAL_USER, e);
+    if(e->frame == NULL)
+      break;
+    if(cnt == 0 || e->offset < start)
+      start = e->offset;
+    if(cnt == 0 || e->offset + (off_t) e->readbytes > end)
+      end = e->offset + e->readbytes;
+    around[cnt++] = e;
   }
+
+  //Start reading the neighbours' whole span in the background, so
+  //that the page reads below find it in the buffer cache
+  if(cnt > 0 && end > start)
+    inode_read_ahead(file_get_inode(entry->f), start, end - start);
+
+  for(i = 0; i < cnt; i++)
+  {
+    if(!load_page(around[i]))
+    {
+      free_frame(around[i]->frame);
+      around[i]->frame = NULL;
+    }
+  }
+  return true;
+}
+
+//Reads ENTRY's contents from its file into the frame it was given,
+//maps it and unpins the frame. A read-only page is offered for other
+//processes to share.
+static bool load_page(struct sup_page_table_entry* entry)
+{
+  uint8_t *page = entry->frame->frame_page;
+
   //Read the file's contents into the page
-  if (file_read (entry->f, page, entry->readbytes) != (int) entry->readbytes)
+  if (file_read_at (entry->f, page, entry->readbytes, entry->offset) != (int) entry->readbytes)
   {
     PANIC("FAIL\n");
     return false; 
@@ -266,6 +352,8 @@ bool vm_allocate(struct sup_page_table_entry* entry)
     PANIC("FAIL\n");
     return false; 
   }
+  publish_shared_page(entry);
+  unpin_frame(entry->frame);
   return true;
 }
 //Grow the stack by getting a physical page to map to the given address
@@ -0,0 +1,218 @@
+#include "vm/vm.h"
+#include <hash.h>
+#include <list.h>
+#include "filesys/file.h"
+#include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
+#include "userprog/pagedir.h"
+
+//A read-only file-backed page that is in memory, keyed by the inode
+//and offset it was read from and by how much of it came from the
+//file, so that every process running the same executable can map
+//the same frame for it. A segment's partial last page and the next
+//segment's first page may start at the same offset but differ.
+struct shared_page
+{
+  struct hash_elem elem;
+  struct inode* inode;
+  off_t offset;
+  uint32_t readbytes;
+  uint32_t zerobytes;
+  struct frame_table_entry* frame;
+  struct list sharers;
+  unsigned ref_cnt;
+};
+
+//Shared pages by (inode, offset). Protected by frame_table_lock, like
+//the frame table whose frames they describe.
+static struct hash shared_pages;
+
+static unsigned shared_page_hash(const struct hash_elem*, void* aux UNUSED);
+static bool shared_page_less(const struct hash_elem*, const struct hash_elem*, void* aux UNUSED);
+
+//Initialize the shared page table
+void share_init(void)
+{
+  hash_init(&shared_pages, shared_page_hash, shared_page_less, NULL);
+}
+
+//Find the shared page for the contents ENTRY is loaded with.
+//Must be called with frame_table_lock held.
+static struct shared_page* find_shared_page(struct sup_page_table_entry* entry)
+{
+  struct shared_page key;
+  key.inode = file_get_inode(entry->f);
+  key.offset = entry->offset;
+  key.readbytes = entry->readbytes;
+  key.zerobytes = entry->zerobytes;
+  struct hash_elem* e = hash_find(&shared_pages, &key.elem);
+  return e != NULL ? hash_entry(e, struct shared_page, elem) : NULL;
+}
+
+//If another process already has the read-only page ENTRY describes
+//in memory, map the same frame for the current process and return
+//true. Returns false if ENTRY has to be loaded.
+bool map_shared_page(struct sup_page_table_entry* entry)
+{
+  bool mapped = false;
+
+  if(entry->writable)
+    return false;
+  lock_acquire(&frame_table_lock);
+  struct shared_page* sp = find_shared_page(entry);
+  //A pinned frame is still being read in or is being evicted
+  if(sp != NULL && !sp->frame->pinned
+     && pagedir_set_page(thread_current()->pagedir, entry->addr, sp->frame->frame_page, false))
+  {
+    entry->frame = sp->frame;
+    entry->shared = sp;
+    list_push_back(&sp->sharers, &entry->share_elem);
+    sp->ref_cnt++;
+    mapped = true;
+  }
+  lock_release(&frame_table_lock);
+  return mapped;
+}
+
+//Offer the frame just loaded for the read-only page ENTRY to other
+//processes that fault on the same file data. If some other process
+//got there first, ENTRY keeps its private copy.
+void publish_shared_page(struct sup_page_table_entry* entry)
+{
+  if(entry->writable)
+    return;
+  struct shared_page* sp = malloc(sizeof *sp);
+  if(sp == NULL)
+    return;
+  sp->inode = inode_reopen(file_get_inode(entry->f));
+  sp->offset = entry->offset;
+  sp->readbytes = entry->readbytes;
+  sp->zerobytes = entry->zerobytes;
+  sp->frame = entry->frame;
+  list_init(&sp->sharers);
+  sp->ref_cnt = 0;
+
+  lock_acquire(&frame_table_lock);
+  if(hash_insert(&shared_pages, &sp->elem) == NULL)
+  {
+    list_push_back(&sp->sharers, &entry->share_elem);
+    sp->ref_cnt = 1;
+    entry->shared = sp;
+    entry->frame->shared = sp;
+    sp = NULL;
+  }
+  lock_release(&frame_table_lock);
+
+  if(sp != NULL)
+  {
+    inode_close(sp->inode);
+    free(sp);
+  }
+}
+
+//Drop the current process's reference to the shared page ENTRY is
+//mapped to, unmapping it. If that was the last reference, removes
+//the shared page from the table and returns it, to be released with
+//free_shared_page() once frame_table_lock is released, and leaves
+//the frame to ENTRY for the caller to free. Otherwise returns NULL.
+//Must be called with frame_table_lock held.
+struct shared_page* unshare_page(struct sup_page_table_entry* entry)
+{
+  struct shared_page* sp = entry->shared;
+
+  pagedir_clear_page(thread_current()->pagedir, entry->addr);
+  list_remove(&entry->share_elem);
+  entry->shared = NULL;
+  if(--sp->ref_cnt == 0)
+  {
+    hash_delete(&shared_pages, &sp->elem);
+    sp->frame->shared = NULL;
+    return sp;
+  }
+
+  entry->frame = NULL;
+  if(sp->frame->page == entry)
+  {
+    //Hand the frame over to a remaining sharer
+    struct sup_page_table_entry* next = list_entry(list_front(&sp->sharers), struct sup_page_table_entry, share_elem);
+    sp->frame->thread = next->owner;
+    sp->frame->page = next;
+  }
+  return NULL;
+}
+
+//Test and clear the accessed bits of every mapping of shared page
+//SP. Must be called with frame_table_lock held.
+bool shared_page_accessed(struct shared_page* sp)
+{
+  bool accessed = false;
+  struct list_elem* e;
+  for(e = list_begin(&sp->sharers); e != list_end(&sp->sharers); e = list_next(e))
+  {
+    struct sup_page_table_entry* s = list_entry(e, struct sup_page_table_entry, share_elem);
+    if(pagedir_is_accessed(s->owner->pagedir, s->addr))
+    {
+      pagedir_set_accessed(s->owner->pagedir, s->addr, false);
+      accessed = true;
+    }
+  }
+  return accessed;
+}
+
+//Unmap shared page SP from every process that maps it. Must be
+//called with frame_table_lock held.
+void shared_page_unmap(struct shared_page* sp)
+{
+  struct list_elem* e;
+  for(e = list_begin(&sp->sharers); e != list_end(&sp->sharers); e = list_next(e))
+  {
+    struct sup_page_table_entry* s = list_entry(e, struct sup_page_table_entry, share_elem);
+    pagedir_clear_page(s->owner->pagedir, s->addr);
+  }
+}
+
+//Forget shared page SP once its frame has been evicted, so that
+//every sharer loads the page again on its next fault. Must be called
+//with frame_table_lock held; release SP afterward with
+//free_shared_page().
+void shared_page_evicted(struct shared_page* sp)
+{
+  while(!list_empty(&sp->sharers))
+  {
+    struct sup_page_table_entry* s = list_entry(list_pop_front(&sp->sharers), struct sup_page_table_entry, share_elem);
+    s->frame = NULL;
+    s->shared = NULL;
+  }
+  hash_delete(&shared_pages, &sp->elem);
+  sp->frame->shared = NULL;
+}
+
+//Release a shared page that is no longer in the table. Closing the
+//inode may write to disk, so call this without frame_table_lock.
+void free_shared_page(struct shared_page* sp)
+{
+  inode_close(sp->inode);
+  free(sp);
+}
+
+//Hash function for the shared page table
+static unsigned shared_page_hash(const struct hash_elem* e, void* aux UNUSED)
+{
+  struct shared_page* sp = hash_entry(e, struct shared_page, elem);
+  return hash_int((int) sp->inode) ^ hash_int(sp->offset) ^ hash_int(sp->readbytes);
+}
+
+//Hash comparison function
+static bool shared_page_less(const struct hash_elem* a_, const struct hash_elem* b_, void* aux UNUSED)
+{
+  struct shared_page* a = hash_entry(a_, struct shared_page, elem);
+  struct shared_page* b = hash_entry(b_, struct shared_page, elem);
+  if(a->inode != b->inode)
+    return a->inode < b->inode;
+  if(a->offset != b->offset)
+    return a->offset < b->offset;
+  if(a->readbytes != b->readbytes)
+    return a->readbytes < b->readbytes;
+  return a->zerobytes < b->zerobytes;
+}
@@ -3,11 +3,43 @@
 #include "devices/block.h"
 #include "threads/vaddr.h"
 #include "threads/synch.h"
+#include "threads/malloc.h"
+#include <round.h>
+#include <stdio.h>
+
+//Number of swap sectors that hold one page
+#define SECTORS_PER_PAGE (PGSIZE/BLOCK_SECTOR_SIZE)
+
+//Number of swap slots in a chunk
+#define CHUNK_SLOTS 256
 
 struct bitmap *swap_space;
 struct block *swap_drive;
 struct lock swap_lock;
 
+//Summary of the free slots in one chunk of CHUNK_SLOTS slots, which
+//lets the allocator decide what a chunk offers without looking at its
+//bits, including runs that continue from one chunk into the next.
+struct swap_chunk
+{
+  size_t free_cnt;
+  size_t head;
+  size_t tail;
+  size_t longest;
+  size_t longest_start;
+};
+
+static struct swap_chunk* chunks;
+static size_t chunk_cnt;
+
+//Slot just past the last allocation. The next allocation starts
+//looking here, instead of at the front of the device, which fills
+//up first.
+static size_t next_slot;
+static size_t used_slots;
+
+static void summarize_chunk(size_t c);
+
 //Initialize the swap space by finding the swap device
 //and by creating the bitmap representation
 void swap_init(void)
@@ -17,22 +49,257 @@ void swap_init(void)
 
   size_t size_in_pages = (block_size(swap_drive) * BLOCK_SECTOR_SIZE)/PGSIZE;
   swap_space = bitmap_create(size_in_pages);
+  chunk_cnt = DIV_ROUND_UP(size_in_pages, CHUNK_SLOTS);
+  chunks = malloc(chunk_cnt * sizeof *chunks);
+  if(swap_space == NULL || chunks == NULL)
+    PANIC("swap table allocation failed");
 
   bitmap_set_all(swap_space, false);
+  size_t i;
+  for(i = 0; i < chunk_cnt; i++)
+    summarize_chunk(i);
+  next_slot = 0;
+  used_slots = 0;
+}
+
+//Returns the first slot past the end of chunk C
+static size_t
+chunk_end(size_t c)
+{
+  size_t end = (c + 1) * CHUNK_SLOTS;
+  return end < bitmap_size(swap_space) ? end : bitmap_size(swap_space);
+}
+
+//Recomputes the summary of chunk C from its bits
+static void
+summarize_chunk(size_t c)
+{
+  struct swap_chunk* ch = &chunks[c];
+  size_t start = c * CHUNK_SLOTS, end = chunk_end(c);
+  size_t i, run = 0;
+
+  ch->free_cnt = ch->longest = ch->longest_start = 0;
+  for(i = start; i < end; i++)
+  {
+    if(bitmap_test(swap_space, i))
+      run = 0;
+    else
+    {
+      ch->free_cnt++;
+      if(++run > ch->longest)
+      {
+        ch->longest = run;
+        ch->longest_start = i - run + 1;
+      }
+    }
+  }
+  ch->tail = run;
+  for(ch->head = 0; start + ch->head < end; ch->head++)
+    if(bitmap_test(swap_space, start + ch->head))
+      break;
+}
+
+//Marks CNT slots starting at SWAP_POS as used or free, keeping the
+//chunk summaries in step. Must be called with swap_lock held.
+static void
+mark_slots(size_t swap_pos, size_t cnt, bool used)
+{
+  size_t c;
+  ASSERT(used ? bitmap_none(swap_space, swap_pos, cnt)
+              : bitmap_all(swap_space, swap_pos, cnt));
+  bitmap_set_multiple(swap_space, swap_pos, cnt, used);
+  for(c = swap_pos / CHUNK_SLOTS; c <= (swap_pos + cnt - 1) / CHUNK_SLOTS; c++)
+    summarize_chunk(c);
+  if(used)
+    used_slots += cnt;
+  else
+    used_slots -= cnt;
+}
+
+//Searches for CNT free slots in a row between START and END and
+//returns the first one, or BITMAP_ERROR if there is no such run.
+static size_t
+scan_range(size_t start, size_t end, size_t cnt)
+{
+  size_t run = 0;
+  for(; start < end; start++)
+  {
+    if(bitmap_test(swap_space, start))
+      run = 0;
+    else if(++run == cnt)
+      return start - cnt + 1;
+  }
+  return BITMAP_ERROR;
+}
+
+//Allocates up to *CNT consecutive slots, next-fit from next_slot,
+//and returns the first one, or BITMAP_ERROR if swap is full. If no
+//run of *CNT free slots exists, allocates the longest run found
+//instead and stores its length into *CNT.
+//
+//Only the part of the cursor's chunk past the cursor is scanned bit
+//by bit. Every other chunk is judged by its summary: a full chunk
+//is skipped, a run carried over from earlier chunks is extended by
+//the chunk's free head, and only a chunk whose longest run is known
+//to be long enough is scanned. A search therefore costs one step per chunk, at most, and
+//no search starts over from slot 0. Must be called with swap_lock
+//held.
+static size_t
+allocate_slots(size_t* cnt)
+{
+  size_t slot_cnt = bitmap_size(swap_space);
+  size_t want = *cnt;
+  size_t best_pos = BITMAP_ERROR, best_len = 0;
+  size_t run = 0, run_start = 0;
+  size_t swap_pos = BITMAP_ERROR;
+  size_t i, s;
+
+  if(used_slots == slot_cnt)
+    return BITMAP_ERROR;
+  if(next_slot >= slot_cnt)
+    next_slot = 0;
+
+  //Visit the cursor's chunk twice: first from the cursor onward,
+  //and last, after all the others, from its beginning.
+  for(i = 0; i <= chunk_cnt && swap_pos == BITMAP_ERROR; i++)
+  {
+    size_t c = (next_slot / CHUNK_SLOTS + i) % chunk_cnt;
+    struct swap_chunk* ch = &chunks[c];
+    size_t start = c * CHUNK_SLOTS, end = chunk_end(c);
+
+    //Runs do not wrap around from the last slot to the first
+    if(c == 0)
+      run = 0;
+
+    if(i == 0)
+    {
+      for(s = next_slot; s < end && swap_pos == BITMAP_ERROR; s++)
+      {
+        if(bitmap_test(swap_space, s))
+          run = 0;
+        else
+        {
+          if(run++ == 0)
+            run_start = s;
+          if(run > best_len)
+          {
+            best_pos = run_start;
+            best_len = run;
+          }
+          if(run == want)
+            swap_pos = run_start;
+        }
+      }
+      continue;
+    }
+
+    //A full chunk only ends the run carried into it, which has
+    //already been weighed against the best run found
+    if(ch->free_cnt == 0)
+    {
+      run = 0;
+      continue;
+    }
+    if(run == 0)
+      run_start = start;
+    if(run + ch->head >= want)
+      swap_pos = run_start;
+    else if(ch->longest >= want)
+      swap_pos = scan_range(start, end, want);
+    else
+    {
+      if(run + ch->head > best_len)
+      {
+        best_pos = run_start;
+        best_len = run + ch->head;
+      }
+      if(ch->longest > best_len)
+      {
+        best_pos = ch->longest_start;
+        best_len = ch->longest;
+      }
+      if(ch->free_cnt == end - start)
+        run += ch->head;
+      else
+      {
+        run = ch->tail;
+        run_start = end - ch->tail;
+      }
+    }
+  }
+
+  if(swap_pos == BITMAP_ERROR)
+  {
+    if(best_len == 0)
+      return BITMAP_ERROR;
+    swap_pos = best_pos;
+    *cnt = best_len;
+  }
+  mark_slots(swap_pos, *cnt, true);
+  next_slot = swap_pos + *cnt;
+  return swap_pos;
+}
+
+//Print how much of the swap device is in use
+void swap_print_stats(void)
+{
+  if(swap_space == NULL)
+    return;
+  lock_acquire(&swap_lock);
+  printf("Swap: %zu pages used, %zu free\n", used_slots, bitmap_size(swap_space) - used_slots);
+  lock_release(&swap_lock);
+}
+
+//Number of free swap slots
+size_t swap_free_cnt(void)
+{
+  lock_acquire(&swap_lock);
+  size_t cnt = bitmap_size(swap_space) - used_slots;
+  lock_release(&swap_lock);
+  return cnt;
+}
+
+//Number of swap slots in use
+size_t swap_used_cnt(void)
+{
+  lock_acquire(&swap_lock);
+  size_t cnt = used_slots;
+  lock_release(&swap_lock);
+  return cnt;
 }
 
 //Insert a frame into swap space
 size_t insert_into_swap(void* frame_page)
 {
+  size_t cnt = 1;
+  size_t swap_pos = insert_cluster_into_swap(&frame_page, &cnt);
+  if(swap_pos == BITMAP_ERROR)
+    PANIC("swap is full");
+  return swap_pos;
+}
+
+//Insert up to *CNT frames into consecutive swap slots, writing them
+//all with a single request. If swap has no run of *CNT free slots,
+//inserts as many of the frames as the longest free run holds. Stores
+//the number inserted into *CNT and returns the first slot, or
+//BITMAP_ERROR if swap is full.
+size_t insert_cluster_into_swap(void** frame_pages, size_t* cnt)
+{
+  struct block_iovec iov[*cnt];
+  size_t i;
+
   lock_acquire(&swap_lock);
-  size_t swap_pos = bitmap_scan(swap_space, 0, 1, false);
-  bitmap_set(swap_space, swap_pos, true);
-  lock_release(&swap_lock); 
-  
-  
-  size_t progress_pos = 0;
-  for(; progress_pos < PGSIZE/BLOCK_SECTOR_SIZE; progress_pos++)
-    block_write (swap_drive, swap_pos * (PGSIZE/BLOCK_SECTOR_SIZE) + progress_pos, frame_page + progress_pos*BLOCK_SECTOR_SIZE);
+  size_t swap_pos = allocate_slots(cnt);
+  lock_release(&swap_lock);
+  if(swap_pos == BITMAP_ERROR)
+    return BITMAP_ERROR;
+
+  for(i = 0; i < *cnt; i++)
+  {
+    iov[i].buffer = frame_pages[i];
+    iov[i].sector_cnt = SECTORS_PER_PAGE;
+  }
+  block_writev(swap_drive, swap_pos * SECTORS_PER_PAGE, iov, *cnt);
 
   return swap_pos;
 }
@@ -41,19 +308,31 @@ size_t insert_into_swap(void* frame_page)
 void clear_swap_entry(size_t swap_pos)
 {
   lock_acquire(&swap_lock);
-  bitmap_set(swap_space, swap_pos, false);
-  lock_release(&swap_lock); 
+  mark_slots(swap_pos, 1, false);
+  lock_release(&swap_lock);
 }
 
 //Read swap data back into main memory
 void retrieve_from_swap(size_t swap_pos, void* frame_page)
 {
+  retrieve_cluster_from_swap(swap_pos, &frame_page, 1);
+}
+
+//Read CNT pages from consecutive swap slots starting at SWAP_POS
+//back into main memory with a single request, and free the slots
+void retrieve_cluster_from_swap(size_t swap_pos, void** frame_pages, size_t cnt)
+{
+  struct block_iovec iov[cnt];
+  size_t i;
 
-  size_t progress_pos = 0;
-  for(; progress_pos < PGSIZE/BLOCK_SECTOR_SIZE; progress_pos++)
-    block_read (swap_drive, swap_pos * (PGSIZE/BLOCK_SECTOR_SIZE) + progress_pos, frame_page + progress_pos*BLOCK_SECTOR_SIZE);
+  for(i = 0; i < cnt; i++)
+  {
+    iov[i].buffer = frame_pages[i];
+    iov[i].sector_cnt = SECTORS_PER_PAGE;
+  }
+  block_readv(swap_drive, swap_pos * SECTORS_PER_PAGE, iov, cnt);
 
   lock_acquire(&swap_lock);
-  bitmap_set(swap_space, swap_pos, false); 
-  lock_release(&swap_lock); 
+  mark_slots(swap_pos, cnt, false);
+  lock_release(&swap_lock);
 }
@@ -6,7 +6,6 @@
 #include "threads/palloc.h"
 #include <bitmap.h>
 
-struct list frame_table;
 struct lock frame_table_lock;
 
 /**enum page_type
@@ -16,12 +15,19 @@ struct lock frame_table_lock;
   SWAP
 };**/
 
+struct shared_page;
+
+//One entry per frame in the user pool, kept in an array indexed by
+//frame number. A frame is in use when thread is not NULL. A frame
+//that several processes map has shared set, and thread and page
+//name one of its sharers.
 struct frame_table_entry
 {
   struct thread* thread;
-  struct list_elem frame_table_elem;
   void* frame_page;
   struct sup_page_table_entry* page;
+  struct shared_page* shared;
+  bool pinned;
 };
 
 
@@ -39,6 +45,9 @@ struct sup_page_table_entry
   size_t swap_table_index;
   bool swapped;
   bool loaded;
+  struct thread* owner;
+  struct shared_page* shared;
+  struct list_elem share_elem;
 };
 
 struct mmap_table_entry
@@ -67,14 +76,33 @@ bool sup_table_less(const struct hash_elem*, const struct hash_elem*, void* aux
 void frame_table_init(void);
 void remove_frame_entry(void *frame);
 struct frame_table_entry *allocate_frame(enum palloc_flags, struct sup_page_table_entry* entry);
+struct frame_table_entry* get_free_frame(enum palloc_flags, struct sup_page_table_entry* entry);
+struct frame_table_entry* get_pool_frame(enum palloc_flags, struct sup_page_table_entry* entry);
+struct frame_table_entry* get_frame_entry(void* frame);
+void unpin_frame(struct frame_table_entry*);
+void wait_for_eviction(struct sup_page_table_entry*);
 void free_frame(struct frame_table_entry *);
 bool bring_from_swap(struct sup_page_table_entry* entry);
 
 
 void swap_init(void);
 size_t insert_into_swap(void* frame_page);
+size_t insert_cluster_into_swap(void** frame_pages, size_t* cnt);
 void clear_swap_entry(size_t swap_pos);
 void retrieve_from_swap(size_t swap_pos, void* frame_page);
+void retrieve_cluster_from_swap(size_t swap_pos, void** frame_pages, size_t cnt);
+void share_init(void);
+bool map_shared_page(struct sup_page_table_entry*);
+void publish_shared_page(struct sup_page_table_entry*);
+struct shared_page* unshare_page(struct sup_page_table_entry*);
+bool shared_page_accessed(struct shared_page*);
+void shared_page_unmap(struct shared_page*);
+void shared_page_evicted(struct shared_page*);
+void free_shared_page(struct shared_page*);
+
+size_t swap_free_cnt(void);
+size_t swap_used_cnt(void);
+void swap_print_stats(void);
 
 
 int insert_mmap_entry (struct file *, int, uint8_t *); 